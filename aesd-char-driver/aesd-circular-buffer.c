@@ -5,9 +5,52 @@
  *      Author: Dan Walkes
  */
 
+#ifdef __KERNEL__
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/errno.h>
+#else
 #include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#endif
 #include "aesd-circular-buffer.h"
 
+#ifdef __KERNEL__
+#define ring_calloc(n, size) kcalloc(n, size, GFP_KERNEL)
+#define ring_free(ptr) kfree(ptr)
+#else
+#define ring_calloc(n, size) calloc(n, size)
+#define ring_free(ptr) free(ptr)
+#endif
+
+/**
+ * @return the slot holding the @param n th oldest entry of @param buffer
+ */
+static inline uint8_t aesd_circular_buffer_slot(const struct aesd_circular_buffer *buffer, unsigned int n)
+{
+    unsigned int slot = buffer->out_offs + n;
+    return slot < buffer->nr_slots ? slot : slot - buffer->nr_slots;
+}
+
+/**
+ * @return the offset of the @param n th oldest entry from the start of @param buffer
+ */
+static size_t aesd_circular_buffer_start(struct aesd_circular_buffer *buffer, unsigned int n)
+{
+    size_t start = 0;
+    unsigned int i;
+
+    if (buffer->ring) {
+        return buffer->ring_start[aesd_circular_buffer_slot(buffer, n)] - buffer->ring_start[buffer->out_offs];
+    }
+    // The baseline ring has no start positions, it is short enough to walk
+    for (i = 0; i < n; i++) {
+        start += buffer->entry[aesd_circular_buffer_slot(buffer, i)].size;
+    }
+    return start;
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.  Any any
  * user space memory checks (ignore for assignment 7)
@@ -20,75 +63,167 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    size_t current_pos = 0;
-    uint8_t index = buffer->out_offs;
-    uint8_t count = 0;
-    uint8_t max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-
-    // Iterate through the entries starting from out_offs
-    while (count < max_entries) {
-        if (count > 0 && index == buffer->out_offs && !buffer->full) {
-            // We've looped back to the start and the buffer isn't full
-            break;
-        }
-        
-        // If we are at an entry that hasn't been filled yet (and buffer is not full)
-        if (!buffer->full && index == buffer->in_offs && count != 0) {
-            break;
-        }
+    struct aesd_buffer_entry *slots = aesd_circular_buffer_slots(buffer);
+    unsigned int lo = 0;
+    unsigned int hi;
+
+    // Lockless readers may see a torn buffer and retry, count == 0 must not
+    // be searched even if size says otherwise
+    if (char_offset >= buffer->size || buffer->count == 0) {
+        return NULL;
+    }
 
-        struct aesd_buffer_entry *entry = &buffer->entry[index];
-        
-        // Check if the requested offset is within this entry
-        if (char_offset < current_pos + entry->size) {
-            if (entry_offset_byte_rtn != NULL) {
-                *entry_offset_byte_rtn = char_offset - current_pos;
+    if (!buffer->ring) {
+        // Walk the entries from the oldest one
+        size_t start = 0;
+        for (lo = 0; lo + 1 < buffer->count; lo++) {
+            size_t size = slots[aesd_circular_buffer_slot(buffer, lo)].size;
+            if (char_offset < start + size) {
+                break;
             }
-            return entry;
+            start += size;
         }
+        if (entry_offset_byte_rtn != NULL) {
+            *entry_offset_byte_rtn = char_offset - start;
+        }
+        return &slots[aesd_circular_buffer_slot(buffer, lo)];
+    }
 
-        current_pos += entry->size;
-        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        count++;
-
-        // If buffer is full, we can check all 10 entries. 
-        // If not full, we check until we hit in_offs.
-        if (!buffer->full && index == buffer->in_offs) {
-            break;
+    // Binary search for the last entry starting at or before char_offset.
+    // It can't be an empty entry: the next one would start there too.
+    hi = buffer->count - 1;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo + 1) / 2;
+        if (aesd_circular_buffer_start(buffer, mid) <= char_offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
         }
     }
 
-    return NULL;
+    if (entry_offset_byte_rtn != NULL) {
+        *entry_offset_byte_rtn = char_offset - aesd_circular_buffer_start(buffer, lo);
+    }
+    return &slots[aesd_circular_buffer_slot(buffer, lo)];
 }
 
 /**
-* Adds entry @param add_entry to @param buffer, overwriting an existing entry if necessary.
+* Adds entry @param add_entry to @param buffer, overwriting the oldest entry if the buffer is full.
+* @return the buffptr of the overwritten entry, for the caller to free, or NULL
 */
-void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
+    struct aesd_buffer_entry *slots = aesd_circular_buffer_slots(buffer);
+    const char *overwritten = NULL;
+
+    // If buffer is already full, drop the oldest entry first (overwriting old
+    // data). In the baseline ring it sits at in_offs, where the new one goes.
+    if (buffer->full) {
+        struct aesd_buffer_entry *oldest = &slots[buffer->out_offs];
+        overwritten = oldest->buffptr;
+        buffer->size -= oldest->size;
+        oldest->buffptr = NULL;
+        oldest->size = 0;
+        buffer->out_offs = aesd_circular_buffer_slot(buffer, 1);
+        buffer->count--;
+    }
+
     // Add the entry at the current in_offs
-    buffer->entry[buffer->in_offs] = *add_entry;
+    slots[buffer->in_offs] = *add_entry;
+    if (buffer->ring) {
+        buffer->ring_start[buffer->in_offs] = buffer->end_pos;
+    }
+    buffer->end_pos += add_entry->size;
+    buffer->size += add_entry->size;
+    buffer->count++;
 
     // Advance in_offs
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->in_offs = buffer->in_offs + 1 < buffer->nr_slots ? buffer->in_offs + 1 : 0;
 
-    // If buffer was already full, we need to advance out_offs as well (overwriting old data)
-    if (buffer->full) {
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->full = buffer->count == buffer->capacity;
+    return overwritten;
+}
+
+/**
+ * @return the @param n th oldest entry of @param buffer, its offset from the
+ * start of the buffer in @param entry_start_rtn, or NULL if there are not
+ * that many entries
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_get_entry(struct aesd_circular_buffer *buffer,
+            unsigned int n, size_t *entry_start_rtn)
+{
+    if (n >= buffer->count) {
+        return NULL;
+    }
+    if (entry_start_rtn != NULL) {
+        *entry_start_rtn = aesd_circular_buffer_start(buffer, n);
     }
+    return &aesd_circular_buffer_slots(buffer)[aesd_circular_buffer_slot(buffer, n)];
+}
 
-    // Check if the buffer is now full
-    if (buffer->in_offs == buffer->out_offs) {
-        buffer->full = true;
-    } else {
-        buffer->full = false;
+/**
+ * @return how many entries of @param buffer are older than @param entry,
+ * which must be one of its slots, so that aesd_circular_buffer_get_entry()
+ * finds it again under that number
+ */
+unsigned int aesd_circular_buffer_entry_index(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *entry)
+{
+    unsigned int slot = entry - aesd_circular_buffer_slots(buffer);
+    return slot >= buffer->out_offs ? slot - buffer->out_offs : slot + buffer->nr_slots - buffer->out_offs;
+}
+
+/**
+* Initializes @param buffer to hold up to @param capacity entries in an
+* allocated ring of the next power of two slots above it.
+* @return 0 on success, -EINVAL for a capacity out of 1..AESDCHAR_MAX_CAPACITY
+* or -ENOMEM
+*/
+int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, unsigned int capacity)
+{
+    unsigned int slots = 1;
+
+    if (capacity < 1 || capacity > AESDCHAR_MAX_CAPACITY) {
+        return -EINVAL;
+    }
+    while (slots <= capacity) {
+        slots <<= 1;
+    }
+
+    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->ring = ring_calloc(slots, sizeof(struct aesd_buffer_entry));
+    buffer->ring_start = ring_calloc(slots, sizeof(size_t));
+    if (!buffer->ring || !buffer->ring_start) {
+        ring_free(buffer->ring);
+        ring_free(buffer->ring_start);
+        buffer->ring = NULL;
+        buffer->ring_start = NULL;
+        return -ENOMEM;
     }
+    buffer->capacity = capacity;
+    buffer->nr_slots = slots;
+    return 0;
 }
 
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
+* with the default capacity of AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
-}
\ No newline at end of file
+    buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->nr_slots = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+* Frees the ring of @param buffer if it was allocated. The entries' own
+* buffers belong to the caller.
+*/
+void aesd_circular_buffer_release(struct aesd_circular_buffer *buffer)
+{
+    ring_free(buffer->ring);
+    ring_free(buffer->ring_start);
+    buffer->ring = NULL;
+    buffer->ring_start = NULL;
+}
@@ -16,7 +16,16 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Default number of entries kept before the oldest one is overwritten
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Largest capacity aesd_circular_buffer_init_capacity() accepts. Ring slots
+ * are indexed with uint8_t and the ring keeps a free slot, so 127 entries
+ * fill the largest ring of 128 slots.
+ */
+#define AESDCHAR_MAX_CAPACITY 127
 
 struct aesd_buffer_entry
 {
@@ -30,6 +39,19 @@ struct aesd_buffer_entry
     size_t size;
 };
 
+/**
+ * A buffer set up with aesd_circular_buffer_init() keeps the baseline
+ * layout: its AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries live in entry,
+ * ring is NULL and a full buffer has in_offs == out_offs. Such a buffer has
+ * no pointers into itself and may be copied by value.
+ *
+ * A buffer set up with aesd_circular_buffer_init_capacity() instead keeps
+ * its entries in an allocated ring of nr_slots slots, the smallest power of
+ * two above capacity, with the stream position of each entry in ring_start.
+ * The slot at in_offs is never in use, so a full buffer has
+ * in_offs == (out_offs + capacity) % nr_slots and the next entry can be
+ * prepared there before it is added. Copies share the ring of the original.
+ */
 struct aesd_circular_buffer
 {
     /**
@@ -49,15 +71,70 @@ struct aesd_circular_buffer
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Number of entries held, at most capacity
+     */
+    uint8_t count;
+    uint8_t capacity;
+    /**
+     * Number of slots in entry, or in ring if it is set
+     */
+    uint8_t nr_slots;
+    /**
+     * The allocated ring of aesd_circular_buffer_init_capacity(), NULL when
+     * the entries are in entry
+     */
+    struct aesd_buffer_entry *ring;
+    /**
+     * Stream position of the first byte of each ring slot's entry. Positions
+     * only grow, so they are sorted in ring order from out_offs and the
+     * offset of an entry within the buffer is
+     * ring_start[slot] - ring_start[out_offs].
+     */
+    size_t *ring_start;
+    /**
+     * Total bytes held by all entries
+     */
+    size_t size;
+    /**
+     * Stream position just past the newest entry
+     */
+    size_t end_pos;
 };
 
+/**
+ * @return the slots holding the entries of @param buffer, nr_slots of them
+ */
+static inline struct aesd_buffer_entry *aesd_circular_buffer_slots(struct aesd_circular_buffer *buffer)
+{
+    return buffer->ring ? buffer->ring : buffer->entry;
+}
+
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
-extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern int aesd_circular_buffer_init_capacity(struct aesd_circular_buffer *buffer, unsigned int capacity);
+
+extern void aesd_circular_buffer_release(struct aesd_circular_buffer *buffer);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_get_entry(struct aesd_circular_buffer *buffer,
+            unsigned int n, size_t *entry_start_rtn);
+
+extern unsigned int aesd_circular_buffer_entry_index(struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *entry);
+
+/**
+ * @return the total number of bytes held by @param buffer, in constant time
+ */
+static inline size_t aesd_circular_buffer_size(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->size;
+}
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
@@ -71,11 +148,12 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
  *      free(entry->buffptr);
  * }
+ * Every slot is visited, those not holding an entry have a NULL buffptr.
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
-    for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
-            index++, entryptr=&((buffer)->entry[index]))
+    for(index=0, entryptr=&(aesd_circular_buffer_slots(buffer)[index]); \
+            index<(buffer)->nr_slots; \
+            index++, entryptr=&(aesd_circular_buffer_slots(buffer)[index]))
 
 
 
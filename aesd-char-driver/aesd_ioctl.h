@@ -33,14 +33,94 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * One range to fetch with AESDCHAR_IOCREADV
+ */
+struct aesd_readv_desc {
+    /**
+     * The zero referenced write command the range starts in
+     */
+    uint32_t write_cmd;
+    /**
+     * The zero referenced offset within the write
+     */
+    uint32_t write_cmd_offset;
+    /**
+     * Bytes wanted, the range continues into the following writes
+     */
+    uint32_t length;
+    /**
+     * Set by the driver: bytes copied for this range, or a negative errno
+     * (-EINVAL if write_cmd/write_cmd_offset is not in the buffer)
+     */
+    int32_t result;
+};
+
+/**
+ * Argument of AESDCHAR_IOCREADV. The ranges are copied one after another into
+ * the user iovec, all from the same snapshot of the buffer.
+ */
+struct aesd_readv {
+    /**
+     * User pointer to nr_descs struct aesd_readv_desc
+     */
+    uint64_t descs;
+    /**
+     * User pointer to iovcnt struct iovec receiving the data
+     */
+    uint64_t iov;
+    uint32_t nr_descs;
+    uint32_t iovcnt;
+};
+
+/**
+ * The most descriptors one AESDCHAR_IOCREADV accepts
+ */
+#define AESDCHAR_READV_MAX 256
+
+/**
+ * Counters of one aesdchar device since the module was loaded, returned by
+ * AESDCHAR_IOCGSTATS
+ */
+struct aesd_stats {
+    uint64_t bytes_written;
+    uint64_t bytes_read;
+    /**
+     * Newline terminated writes added to the circular buffer
+     */
+    uint64_t entries_committed;
+    /**
+     * Entries dropped to make room for a new one
+     */
+    uint64_t entries_evicted;
+    /**
+     * Nanoseconds writers and locked readers spent waiting for the device lock
+     */
+    uint64_t lock_wait_ns;
+    /**
+     * Partial writes that had to grow the buffer of the unterminated entry
+     */
+    uint64_t stage_reallocs;
+    /**
+     * Partial commands left by a closing writer that could not be joined to
+     * the one already pending for lack of memory, so the pending one was
+     * committed as an entry of its own
+     */
+    uint64_t leftover_flushes;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Fill several ranges in one call, returns the total number of bytes copied
+#define AESDCHAR_IOCREADV _IOWR(AESD_IOC_MAGIC, 2, struct aesd_readv)
+// Read the device statistics
+#define AESDCHAR_IOCGSTATS _IOR(AESD_IOC_MAGIC, 3, struct aesd_stats)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 3
 
 #endif /* AESD_IOCTL_H */
@@ -0,0 +1,86 @@
+/*
+ * aesd_mmap.h
+ *
+ *  @brief Layout of the read-only history mapping of an aesd char device
+ *
+ * mmap() of /dev/aesdcharN maps a header page followed by one fixed size
+ * storage slot per circular buffer slot:
+ *
+ *   offset 0                                     struct aesd_mmap_header
+ *   offset AESD_MMAP_HEADER_SIZE + i * slot_size contents of slot i
+ *
+ * Entries longer than slot_size are kept by the driver only and show up
+ * with AESD_MMAP_SLOT_MAPPED clear. The mapping can't be written.
+ *
+ * The driver bumps seq to an odd value before it touches the header and to
+ * the next even value once done. It fills the slot of a new entry while that
+ * slot is not listed in the header, and the header change that retires a
+ * slot bumps seq before the slot is reused. A reader copies what it needs
+ * between two reads of seq and retries if they differ or are odd:
+ *
+ *   do {
+ *       seq = load_acquire(&hdr->seq);
+ *       if (seq & 1) continue;
+ *       ... copy header fields and slot contents ...
+ *       atomic_thread_fence(acquire);
+ *   } while (seq & 1 || seq != hdr->seq);
+ *
+ * A reader tailing the history polls seq, no system call is needed.
+ */
+
+#ifndef AESD_MMAP_H
+#define AESD_MMAP_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#define AESD_MMAP_MAGIC 0x61657364  /* "aesd" */
+#define AESD_MMAP_HEADER_SIZE 4096
+
+/**
+ * Set in aesd_mmap_slot.flags when the entry's bytes are in the slot storage
+ */
+#define AESD_MMAP_SLOT_MAPPED 0x1
+
+struct aesd_mmap_slot {
+    /**
+     * Stream position of the entry's first byte, as in the circular buffer
+     */
+    uint64_t start;
+    /**
+     * Entry length, 0 for a slot not holding an entry
+     */
+    uint32_t size;
+    uint32_t flags;
+};
+
+struct aesd_mmap_header {
+    uint32_t magic;
+    /**
+     * Odd while the driver is updating the mapping, see above
+     */
+    uint32_t seq;
+    /**
+     * Number of slots, a power of two, and the storage bytes of each
+     */
+    uint32_t nr_slots;
+    uint32_t slot_size;
+    /**
+     * Circular buffer state: next slot written, oldest slot, entries held
+     */
+    uint32_t in_offs;
+    uint32_t out_offs;
+    uint32_t count;
+    uint32_t reserved;
+    /**
+     * Bytes held by all entries, and the stream position past the newest one
+     */
+    uint64_t size;
+    uint64_t end_pos;
+    struct aesd_mmap_slot slot[];
+};
+
+#endif /* AESD_MMAP_H */
@@ -9,29 +9,94 @@
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
 #include "aesd-circular-buffer.h"
+#include "aesd_mmap.h"
+#include "aesd_ioctl.h"
 #include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
-
+/*
+ * Kernel debug messages go through pr_debug(). With CONFIG_DYNAMIC_DEBUG they
+ * cost a not-taken branch until enabled at run time:
+ *   echo 'module aesdchar +p' > /sys/kernel/debug/dynamic_debug/control
+ * Building with DEBUG=y prints them unconditionally.
+ */
 #undef PDEBUG             /* undef it, just in case */
-#ifdef AESD_DEBUG
-#  ifdef __KERNEL__
-     /* This one if debugging is on, and kernel space */
-#    define PDEBUG(fmt, args...) printk( KERN_DEBUG "aesdchar: " fmt, ## args)
-#  else
+#ifdef __KERNEL__
+#  define PDEBUG(fmt, args...) pr_debug("aesdchar: " fmt "\n", ## args)
+#elif defined(AESD_DEBUG)
      /* This one for user space */
-#    define PDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
-#  endif
+#  define PDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
 #else
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/*
+ * Each minor is an independent log: /dev/aesdchar0..nr_devs-1 never share
+ * a buffer or a lock, so writers on different minors do not contend.
+ */
+#define AESD_NR_DEVS 1      /* default for the nr_devs module parameter */
+#define AESD_MAX_DEVS 64
+
+/*
+ * Storage bytes per circular buffer slot in the mmap arena, entries that
+ * fit are kept there so readers can map them; see aesd_mmap.h
+ */
+#define AESD_MMAP_SLOT_SIZE 4096
+#define AESD_MMAP_SLOT_SIZE_MAX (1024 * 1024)
+
+/*
+ * Buffer a write is assembled in. Buffers of up to mmap_slot_size bytes, but
+ * no more than a page, come from a kmem_cache of that object size, larger
+ * ones from kvmalloc().
+ */
+struct aesd_stage
+{
+    char *buf;
+    size_t cap;
+};
+
 struct aesd_dev
 {
     struct aesd_circular_buffer buffer;
-    struct mutex lock;
-    struct aesd_buffer_entry working_entry;
+    struct mutex lock;    /* serializes writers */
+    seqcount_mutex_t seq; /* lets readers skip the lock, see aesd_read() */
+    wait_queue_head_t readq;  /* readers waiting at the end for a new entry */
+    struct aesd_stage leftover;  /* partial command of a writer that closed */
+    size_t leftover_size;
     struct cdev cdev;     /* Char device structure      */
+    void *arena;          /* vmalloc_user() header page and slot storage */
+    size_t arena_size;
+    struct aesd_mmap_header *mmap_hdr;  /* start of arena */
+    struct aesd_stats __percpu *stats;  /* summed by AESDCHAR_IOCGSTATS */
+    u64 generation;       /* entries evicted so far, bumped under dev->seq */
+};
+
+/*
+ * Where the last read of an open file stopped, so the next read at that
+ * position continues without looking it up. Positions count from the oldest
+ * entry, so the cursor holds until an eviction shifts them.
+ */
+struct aesd_cursor
+{
+    loff_t pos;           /* file position the cursor stands at, -1 if unset */
+    unsigned int entry;   /* index of the entry from the oldest one */
+    size_t offset;        /* bytes into that entry, short of its size */
+    u64 generation;       /* dev->generation the cursor was set at */
+};
+
+/*
+ * private_data of an open aesdchar minor
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    spinlock_t lock;      /* reads of one file may run concurrently */
+    struct aesd_cursor cursor;
+    struct mutex write_lock;    /* serializes writes through this file */
+    struct aesd_stage working;  /* command being assembled, reused once committed */
+    size_t working_size;
 };
 
 
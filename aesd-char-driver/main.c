@@ -12,188 +12,908 @@
  */
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/init.h>
 #include <linux/printk.h>
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/version.h>
+#include <linux/seqlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/splice.h>
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
+int aesd_nr_devs = AESD_NR_DEVS;
+int aesd_capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+
+module_param_named(nr_devs, aesd_nr_devs, int, S_IRUGO);
+MODULE_PARM_DESC(nr_devs, "Number of aesdchar minors, each with its own buffer and lock");
+int aesd_mmap_slot_size = AESD_MMAP_SLOT_SIZE;
+static bool aesd_follow;
+
+module_param_named(capacity, aesd_capacity, int, S_IRUGO);
+MODULE_PARM_DESC(capacity, "Write operations each device keeps, 1..127 (default 10)");
+module_param_named(mmap_slot_size, aesd_mmap_slot_size, int, S_IRUGO);
+MODULE_PARM_DESC(mmap_slot_size, "Bytes of mmap storage per entry, longer entries are not mapped (default 4096)");
+module_param_named(follow, aesd_follow, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(follow, "Blocking reads at the end wait for the next write instead of returning 0 (default off)");
 
 MODULE_AUTHOR("Mathalama");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices;
+static struct dentry *aesd_debugfs;
 
-int aesd_open(struct inode *inode, struct file *filp)
+/*
+ * Counters are per CPU so the hot paths never share a cache line for them,
+ * AESDCHAR_IOCGSTATS and debugfs sum them up
+ */
+#define aesd_stat_add(dev, field, n) this_cpu_add((dev)->stats->field, (n))
+
+static void aesd_stats_sum(struct aesd_dev *dev, struct aesd_stats *sum)
 {
-    struct aesd_dev *dev;
-    PDEBUG("open");
-    dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-    filp->private_data = dev;
+    int cpu;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        const struct aesd_stats *st = per_cpu_ptr(dev->stats, cpu);
+        sum->bytes_written += READ_ONCE(st->bytes_written);
+        sum->bytes_read += READ_ONCE(st->bytes_read);
+        sum->entries_committed += READ_ONCE(st->entries_committed);
+        sum->entries_evicted += READ_ONCE(st->entries_evicted);
+        sum->lock_wait_ns += READ_ONCE(st->lock_wait_ns);
+        sum->stage_reallocs += READ_ONCE(st->stage_reallocs);
+        sum->leftover_flushes += READ_ONCE(st->leftover_flushes);
+    }
+}
+
+/*
+ * Take dev->lock, accounting the time spent waiting when it is contended
+ */
+static int aesd_lock(struct aesd_dev *dev)
+{
+    u64 start;
+
+    if (mutex_trylock(&dev->lock))
+        return 0;
+    start = ktime_get_ns();
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+    aesd_stat_add(dev, lock_wait_ns, ktime_get_ns() - start);
     return 0;
 }
 
-int aesd_release(struct inode *inode, struct file *filp)
+static char *aesd_arena_slot(struct aesd_dev *dev, uint8_t slot)
 {
-    PDEBUG("release");
+    return (char *)dev->arena + AESD_MMAP_HEADER_SIZE + (size_t)slot * aesd_mmap_slot_size;
+}
+
+static bool aesd_in_arena(struct aesd_dev *dev, const char *ptr)
+{
+    return ptr >= (char *)dev->arena && ptr < (char *)dev->arena + dev->arena_size;
+}
+
+#ifndef ITER_DEST
+#define ITER_DEST READ
+#define ITER_SOURCE WRITE
+#endif
+
+static struct kmem_cache *aesd_stage_cache;
+static size_t aesd_stage_cache_size;
+
+static int aesd_stage_alloc(struct aesd_stage *stage, size_t cap)
+{
+    if (cap <= aesd_stage_cache_size) {
+        stage->buf = kmem_cache_alloc(aesd_stage_cache, GFP_KERNEL);
+        cap = aesd_stage_cache_size;
+    } else {
+        stage->buf = kvmalloc(cap, GFP_KERNEL);
+    }
+    stage->cap = stage->buf ? cap : 0;
+    return stage->buf ? 0 : -ENOMEM;
+}
+
+static void aesd_stage_free(struct aesd_stage *stage)
+{
+    if (!stage->buf)
+        return;
+    if (stage->cap <= aesd_stage_cache_size)
+        kmem_cache_free(aesd_stage_cache, stage->buf);
+    else
+        kvfree(stage->buf);
+    stage->buf = NULL;
+    stage->cap = 0;
+}
+
+/*
+ * Entries live either in their arena slot or, when too long for it, in
+ * the kvmalloc() buffer they were assembled in
+ */
+static void aesd_free_entry(struct aesd_dev *dev, const char *ptr)
+{
+    if (ptr && !aesd_in_arena(dev, ptr))
+        kvfree(ptr);
+}
+
+/*
+ * Readers don't take dev->lock. Writers change the circular buffer inside a
+ * dev->seq write section, so a reader looks an offset up in a retry loop and
+ * gets a consistent entry. Entries in the mmap arena are copied straight
+ * from there: the storage never goes away, and a copy that raced with the
+ * slot being recycled is redone once the sequence shows it. Entries too long
+ * for the arena can be freed by a writer, so those are read under the lock.
+ */
+
+/*
+ * Each read works on a copy of its file's cursor and stores it back at the
+ * end; concurrent reads of one file just keep the last cursor stored.
+ */
+static void aesd_cursor_load(struct aesd_file *file, struct aesd_cursor *cur)
+{
+    spin_lock(&file->lock);
+    *cur = file->cursor;
+    spin_unlock(&file->lock);
+}
+
+static void aesd_cursor_store(struct aesd_file *file, const struct aesd_cursor *cur)
+{
+    spin_lock(&file->lock);
+    file->cursor = *cur;
+    spin_unlock(&file->lock);
+}
+
+/*
+ * Find the entry holding @pos and set @at to it. While no entry was evicted
+ * a cursor standing at @pos still names the right entry, so sequential reads
+ * skip the lookup. Called under dev->lock or in a dev->seq read section.
+ */
+static struct aesd_buffer_entry *aesd_cursor_find(struct aesd_dev *dev, const struct aesd_cursor *cur,
+                loff_t pos, struct aesd_cursor *at)
+{
+    struct aesd_buffer_entry *entry;
+    size_t entry_offset_byte = 0;
+
+    at->pos = pos;
+    at->generation = READ_ONCE(dev->generation);
+    if (cur->pos == pos && cur->generation == at->generation) {
+        at->entry = cur->entry;
+        at->offset = cur->offset;
+        return aesd_circular_buffer_get_entry(&dev->buffer, at->entry, NULL);
+    }
+
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, pos, &entry_offset_byte);
+    if (entry) {
+        at->entry = aesd_circular_buffer_entry_index(&dev->buffer, entry);
+        at->offset = entry_offset_byte;
+    }
+    return entry;
+}
+
+/*
+ * Move @cur past @n bytes read from its entry, @left of which were left
+ */
+static void aesd_cursor_advance(struct aesd_cursor *cur, size_t left, size_t n)
+{
+    cur->pos += n;
+    if (n < left) {
+        cur->offset += n;
+    } else {
+        cur->entry++;
+        cur->offset = 0;
+    }
+}
+
+/*
+ * Find the bytes at @pos, moving @cur there. Returns 1 with them in
+ * @ptr/@len, which stay valid while read_seqcount_retry(&dev->seq, *@seq)
+ * is false, 0 at the end of the buffer, or -EAGAIN if the entry is not in
+ * the arena.
+ */
+static int aesd_find_lockless(struct aesd_dev *dev, struct aesd_cursor *cur, loff_t pos,
+                const char **ptr, size_t *len, unsigned int *seq)
+{
+    struct aesd_buffer_entry *entry;
+    struct aesd_cursor at;
+
+    do {
+        *seq = read_seqcount_begin(&dev->seq);
+        entry = aesd_cursor_find(dev, cur, pos, &at);
+        if (entry) {
+            *ptr = READ_ONCE(entry->buffptr) + at.offset;
+            *len = READ_ONCE(entry->size) - at.offset;
+        }
+    } while (read_seqcount_retry(&dev->seq, *seq));
+
+    if (!entry)
+        return 0;
+    *cur = at;
+    return aesd_in_arena(dev, *ptr) ? 1 : -EAGAIN;
+}
+
+/*
+ * With the follow parameter set, a blocking reader at the end of the buffer
+ * sleeps until a writer commits another entry, then continues at the start
+ * of what was added, like tail -f. Positions count from the oldest entry, so
+ * once the buffer wraps the old end is no longer where the new data begins.
+ * By default, and always with O_NONBLOCK, the read returns 0 at the end so
+ * cat and the assignment tests see end of file.
+ */
+static int aesd_wait_for_data(struct aesd_dev *dev, struct file *filp, loff_t *pos)
+{
+    size_t size, end_seen, end_now, added;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        size = aesd_circular_buffer_size(&dev->buffer);
+        end_seen = dev->buffer.end_pos;
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    if (*pos < size || !READ_ONCE(aesd_follow) || (filp->f_flags & O_NONBLOCK))
+        return 0;
+
+    if (wait_event_interruptible(dev->readq, READ_ONCE(dev->buffer.end_pos) != end_seen))
+        return -ERESTARTSYS;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        size = aesd_circular_buffer_size(&dev->buffer);
+        end_now = dev->buffer.end_pos;
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    added = end_now - end_seen;
+    *pos = added < size ? size - added : 0;
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+static ssize_t aesd_read_locked(struct aesd_dev *dev, struct aesd_cursor *cur,
+                char __user *buf, size_t count, loff_t *f_pos)
 {
     ssize_t retval = 0;
-    struct aesd_dev *dev = filp->private_data;
     struct aesd_buffer_entry *entry;
-    size_t entry_offset_byte = 0;
+    struct aesd_cursor at;
+    size_t left;
     size_t bytes_to_copy;
 
-    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
-
-    if (mutex_lock_interruptible(&dev->lock))
+    if (aesd_lock(dev))
         return -ERESTARTSYS;
 
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, *f_pos, &entry_offset_byte);
+    while (count > 0) {
+        entry = aesd_cursor_find(dev, cur, *f_pos, &at);
+        if (!entry)
+            break;
 
-    if (entry) {
-        bytes_to_copy = entry->size - entry_offset_byte;
-        if (bytes_to_copy > count)
-            bytes_to_copy = count;
-
-        if (copy_to_user(buf, entry->buffptr + entry_offset_byte, bytes_to_copy)) {
-            retval = -EFAULT;
-        } else {
-            retval = bytes_to_copy;
-            *f_pos += bytes_to_copy;
+        left = entry->size - at.offset;
+        bytes_to_copy = min(left, count);
+
+        if (copy_to_user(buf + retval, entry->buffptr + at.offset, bytes_to_copy)) {
+            if (retval == 0)
+                retval = -EFAULT;
+            break;
         }
+        aesd_cursor_advance(&at, left, bytes_to_copy);
+        *cur = at;
+        retval += bytes_to_copy;
+        *f_pos += bytes_to_copy;
+        count -= bytes_to_copy;
     }
 
     mutex_unlock(&dev->lock);
     return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
+/*
+ * Copies entry after entry until the request is satisfied or the buffer
+ * ends, so one call drains the device. The file's cursor carries the entry
+ * reached over to the next call.
+ */
+ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
-    ssize_t retval = -ENOMEM;
-    struct aesd_dev *dev = filp->private_data;
-    char *new_buffptr;
-    const char *overwritten_ptr = NULL;
+    ssize_t retval = 0;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_cursor cur;
+    const char *ptr;
+    size_t left;
+    size_t bytes_to_copy;
+    unsigned int seq;
+    ssize_t rc;
 
-    PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
+    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
 
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+    if (count == 0)
+        return 0;
+    rc = aesd_wait_for_data(dev, filp, f_pos);
+    if (rc)
+        return rc;
 
-    new_buffptr = krealloc(dev->working_entry.buffptr, dev->working_entry.size + count, GFP_KERNEL);
-    if (!new_buffptr) {
-        goto out;
+    aesd_cursor_load(file, &cur);
+    while (count > 0) {
+        rc = aesd_find_lockless(dev, &cur, *f_pos, &ptr, &left, &seq);
+        if (rc == 0)
+            break;
+        if (rc < 0) {
+            rc = aesd_read_locked(dev, &cur, buf + retval, count, f_pos);
+            if (rc > 0 || retval == 0)
+                retval += rc;
+            break;
+        }
+
+        bytes_to_copy = min(left, count);
+        if (copy_to_user(buf + retval, ptr, bytes_to_copy)) {
+            if (retval == 0)
+                retval = -EFAULT;
+            break;
+        }
+        if (read_seqcount_retry(&dev->seq, seq))
+            continue;  // slot recycled while copying, copy it again
+        aesd_cursor_advance(&cur, left, bytes_to_copy);
+        retval += bytes_to_copy;
+        *f_pos += bytes_to_copy;
+        count -= bytes_to_copy;
     }
+    aesd_cursor_store(file, &cur);
 
-    if (copy_from_user(new_buffptr + dev->working_entry.size, buf, count)) {
-        retval = -EFAULT;
-        dev->working_entry.buffptr = new_buffptr;
-        goto out;
+    if (retval > 0)
+        aesd_stat_add(dev, bytes_read, retval);
+    return retval;
+}
+
+static ssize_t aesd_read_iter_locked(struct aesd_dev *dev, struct aesd_cursor *cur,
+                struct kiocb *iocb, struct iov_iter *to)
+{
+    ssize_t retval = 0;
+    struct aesd_buffer_entry *entry;
+    struct aesd_cursor at;
+    size_t bytes_to_copy;
+    size_t copied;
+
+    if (aesd_lock(dev))
+        return -ERESTARTSYS;
+
+    while (iov_iter_count(to) > 0) {
+        entry = aesd_cursor_find(dev, cur, iocb->ki_pos, &at);
+        if (!entry)
+            break;
+
+        bytes_to_copy = entry->size - at.offset;
+        copied = copy_to_iter(entry->buffptr + at.offset, bytes_to_copy, to);
+        aesd_cursor_advance(&at, bytes_to_copy, copied);
+        *cur = at;
+        retval += copied;
+        iocb->ki_pos += copied;
+        if (copied < bytes_to_copy) {
+            // Faulted or out of room: report the error only if nothing was read
+            if (retval == 0 && iov_iter_count(to) > 0)
+                retval = -EFAULT;
+            break;
+        }
     }
 
-    dev->working_entry.buffptr = new_buffptr;
-    dev->working_entry.size += count;
-    retval = count;
+    mutex_unlock(&dev->lock);
+    return retval;
+}
+
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    ssize_t retval = 0;
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_cursor cur;
+    const char *ptr;
+    size_t left;
+    size_t bytes_to_copy;
+    size_t copied;
+    unsigned int seq;
+    ssize_t rc;
+
+    PDEBUG("read_iter %zu bytes with offset %lld", iov_iter_count(to), iocb->ki_pos);
+
+    if (iov_iter_count(to) == 0)
+        return 0;
+    rc = aesd_wait_for_data(dev, iocb->ki_filp, &iocb->ki_pos);
+    if (rc)
+        return rc;
+
+    aesd_cursor_load(file, &cur);
+    while (iov_iter_count(to) > 0) {
+        rc = aesd_find_lockless(dev, &cur, iocb->ki_pos, &ptr, &left, &seq);
+        if (rc == 0)
+            break;
+        if (rc < 0) {
+            rc = aesd_read_iter_locked(dev, &cur, iocb, to);
+            if (rc > 0 || retval == 0)
+                retval += rc;
+            break;
+        }
 
-    if (memchr(dev->working_entry.buffptr + dev->working_entry.size - count, '\n', count)) {
-        if (dev->buffer.full) {
-            overwritten_ptr = dev->buffer.entry[dev->buffer.in_offs].buffptr;
+        bytes_to_copy = min(left, iov_iter_count(to));
+        copied = copy_to_iter(ptr, bytes_to_copy, to);
+        if (read_seqcount_retry(&dev->seq, seq)) {
+            iov_iter_revert(to, copied);  // slot recycled while copying
+            continue;
         }
-        
-        aesd_circular_buffer_add_entry(&dev->buffer, &dev->working_entry);
-        
-        if (overwritten_ptr) {
-            kfree(overwritten_ptr);
+        aesd_cursor_advance(&cur, left, copied);
+        retval += copied;
+        iocb->ki_pos += copied;
+        if (copied < bytes_to_copy) {
+            if (retval == 0)
+                retval = -EFAULT;
+            break;
         }
+    }
+    aesd_cursor_store(file, &cur);
+
+    if (retval > 0)
+        aesd_stat_add(dev, bytes_read, retval);
+    return retval;
+}
+
+/*
+ * sendfile() and splice() from the device. Each entry is copied once, by
+ * aesd_read_iter(), into pages the pipe owns, and the socket end takes those
+ * pages by reference. The arena slots themselves are not lent to the pipe:
+ * they are recycled in place, so a later write could rewrite bytes still
+ * queued on a socket.
+ */
+ssize_t aesd_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe,
+                size_t len, unsigned int flags)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    return copy_splice_read(in, ppos, pipe, len, flags);
+#else
+    return generic_file_splice_read(in, ppos, pipe, len, flags);
+#endif
+}
+
+/*
+ * Mapped readers retry whatever they copied while seq was odd or changed,
+ * see aesd_mmap.h
+ */
+static void aesd_mmap_begin(struct aesd_mmap_header *hdr)
+{
+    WRITE_ONCE(hdr->seq, hdr->seq + 1);
+    smp_wmb();
+}
+
+static void aesd_mmap_end(struct aesd_mmap_header *hdr)
+{
+    smp_wmb();
+    WRITE_ONCE(hdr->seq, hdr->seq + 1);
+}
+
+/*
+ * Add the @size bytes assembled in @stage to the circular buffer as an
+ * entry and publish the change to mapped readers. An entry that fits is
+ * copied into its arena slot and @stage is kept for the next command; a
+ * longer one takes the buffer of @stage with it. Called with dev->lock held,
+ * nothing is allocated or freed here.
+ * @return the overwritten entry for the caller to free after unlocking
+ */
+static const char *aesd_commit_entry(struct aesd_dev *dev, struct aesd_stage *stage, size_t size)
+{
+    struct aesd_mmap_header *hdr = dev->mmap_hdr;
+    uint8_t slot = dev->buffer.in_offs;
+    uint8_t evicted = dev->buffer.out_offs;
+    bool was_full = dev->buffer.full;
+    bool mapped = size <= (size_t)aesd_mmap_slot_size;
+    struct aesd_buffer_entry entry = { .buffptr = stage->buf, .size = size };
+    const char *overwritten;
 
-        dev->working_entry.buffptr = NULL;
-        dev->working_entry.size = 0;
+    // The ring of aesd_circular_buffer_init_capacity() always has a free
+    // slot at in_offs, so the copy goes in before the write section and
+    // readers only retry for the pointer updates. A reader still copying
+    // from the slot's old entry started before that entry was evicted, and
+    // its seq check fails on the eviction.
+    if (mapped) {
+        char *storage = aesd_arena_slot(dev, slot);
+        memcpy(storage, stage->buf, size);
+        entry.buffptr = storage;
+    } else {
+        stage->buf = NULL;
+        stage->cap = 0;
     }
 
-out:
+    write_seqcount_begin(&dev->seq);
+    aesd_mmap_begin(hdr);
+
+    overwritten = aesd_circular_buffer_add_entry(&dev->buffer, &entry);
+    aesd_stat_add(dev, entries_committed, 1);
+
+    if (was_full) {
+        // Positions now count from the next entry, cursors are stale
+        WRITE_ONCE(dev->generation, dev->generation + 1);
+        aesd_stat_add(dev, entries_evicted, 1);
+        hdr->slot[evicted].size = 0;
+        hdr->slot[evicted].flags = 0;
+    }
+    hdr->slot[slot].start = dev->buffer.ring_start[slot];
+    hdr->slot[slot].size = size;
+    hdr->slot[slot].flags = mapped ? AESD_MMAP_SLOT_MAPPED : 0;
+    hdr->in_offs = dev->buffer.in_offs;
+    hdr->out_offs = dev->buffer.out_offs;
+    hdr->count = dev->buffer.count;
+    hdr->size = aesd_circular_buffer_size(&dev->buffer);
+    hdr->end_pos = dev->buffer.end_pos;
+
+    aesd_mmap_end(hdr);
+    write_seqcount_end(&dev->seq);
+    return overwritten;
+}
+
+/*
+ * Make room for @need bytes in the working buffer of @file, keeping the
+ * partial command already in it. Doubling keeps a long run of partial
+ * writes from regrowing each time.
+ */
+static int aesd_file_reserve(struct aesd_file *file, size_t need)
+{
+    struct aesd_stage grown;
+
+    if (need <= file->working.cap)
+        return 0;
+    if (aesd_stage_alloc(&grown, max(need, 2 * file->working.cap)))
+        return -ENOMEM;
+    if (file->working_size > 0) {
+        aesd_stat_add(file->dev, stage_reallocs, 1);
+        memcpy(grown.buf, file->working.buf, file->working_size);
+    }
+    aesd_stage_free(&file->working);
+    file->working = grown;
+    return 0;
+}
+
+/*
+ * A writer that closes in the middle of a command leaves it on the device,
+ * and the next write through any file continues it, as writes from
+ * successive `echo -n` processes expect
+ */
+static void aesd_file_adopt_leftover(struct aesd_file *file)
+{
+    struct aesd_dev *dev = file->dev;
+    struct aesd_stage swap;
+
+    if (file->working_size > 0 || READ_ONCE(dev->leftover_size) == 0)
+        return;
+    mutex_lock(&dev->lock);
+    swap = file->working;
+    file->working = dev->leftover;
+    dev->leftover = swap;
+    file->working_size = dev->leftover_size;
+    dev->leftover_size = 0;
     mutex_unlock(&dev->lock);
-    return retval;
 }
 
-loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
+/*
+ * Join the partial command of @file after the one pending on the device.
+ * Both were acknowledged to their writers, so without memory to join them
+ * the pending one is committed as an entry of its own rather than dropped.
+ * Called with dev->lock held.
+ * @return true if it was committed, with the entry it overwrote in
+ * @overwritten for the caller to free
+ */
+static bool aesd_leftover_join(struct aesd_dev *dev, struct aesd_file *file, const char **overwritten)
 {
-    struct aesd_dev *dev = filp->private_data;
-    loff_t total_size = 0;
-    uint8_t index;
-    struct aesd_buffer_entry *entry;
+    size_t need = dev->leftover_size + file->working_size;
+    bool committed = false;
+    struct aesd_stage swap;
 
-    if (mutex_lock_interruptible(&dev->lock))
+    if (need <= dev->leftover.cap) {
+        memcpy(dev->leftover.buf + dev->leftover_size, file->working.buf, file->working_size);
+        dev->leftover_size = need;
+        return false;
+    }
+    if (need <= file->working.cap) {
+        // The file's buffer has the room, put the pending bytes in front
+        memmove(file->working.buf + dev->leftover_size, file->working.buf, file->working_size);
+        memcpy(file->working.buf, dev->leftover.buf, dev->leftover_size);
+        file->working_size = need;
+    } else if (aesd_stage_alloc(&swap, need) == 0) {
+        memcpy(swap.buf, dev->leftover.buf, dev->leftover_size);
+        memcpy(swap.buf + dev->leftover_size, file->working.buf, file->working_size);
+        aesd_stage_free(&file->working);
+        file->working = swap;
+        file->working_size = need;
+    } else {
+        pr_warn_ratelimited("aesdchar: no memory to join partial writes, committing %zu pending bytes\n",
+                            dev->leftover_size);
+        aesd_stat_add(dev, leftover_flushes, 1);
+        *overwritten = aesd_commit_entry(dev, &dev->leftover, dev->leftover_size);
+        committed = true;
+    }
+    dev->leftover_size = 0;
+    return committed;
+}
+
+static void aesd_file_leave_leftover(struct aesd_file *file)
+{
+    struct aesd_dev *dev = file->dev;
+    const char *overwritten = NULL;
+    bool committed = false;
+    struct aesd_stage swap;
+
+    mutex_lock(&dev->lock);
+    // Two writers closed mid-command, rare enough to copy under the lock
+    if (dev->leftover_size > 0)
+        committed = aesd_leftover_join(dev, file, &overwritten);
+    if (dev->leftover_size == 0) {
+        swap = dev->leftover;
+        dev->leftover = file->working;
+        file->working = swap;
+        dev->leftover_size = file->working_size;
+    }
+    mutex_unlock(&dev->lock);
+    file->working_size = 0;
+
+    if (committed) {
+        wake_up_interruptible(&dev->readq);
+        aesd_free_entry(dev, overwritten);
+    }
+}
+
+/*
+ * Each open file assembles its own command: the user data is copied into
+ * the file's working buffer with only file->write_lock held, so concurrent
+ * writers never splice their partial commands together nor wait on each
+ * other's copies. dev->lock is only taken to commit a completed command,
+ * which all the segments of a writev() join as one entry.
+ */
+static ssize_t aesd_write_from(struct aesd_file *file, struct iov_iter *from)
+{
+    struct aesd_dev *dev = file->dev;
+    size_t count = iov_iter_count(from);
+    const char *overwritten = NULL;
+    ssize_t retval = count;
+    bool completes;
+
+    if (count == 0)
+        return 0;
+    if (mutex_lock_interruptible(&file->write_lock))
         return -ERESTARTSYS;
+    aesd_file_adopt_leftover(file);
 
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buffer, index) {
-        total_size += entry->size;
+    if (aesd_file_reserve(file, file->working_size + count)) {
+        retval = -ENOMEM;
+        goto out_unlock;
+    }
+    // A write that faults adds nothing to the command
+    if (copy_from_iter(file->working.buf + file->working_size, count, from) != count) {
+        retval = -EFAULT;
+        goto out_unlock;
     }
+    completes = memchr(file->working.buf + file->working_size, '\n', count) != NULL;
+    file->working_size += count;
 
-    mutex_unlock(&dev->lock);
+    if (completes) {
+        if (aesd_lock(dev)) {
+            // Keep the command, a retried write may complete it again
+            file->working_size -= count;
+            retval = -ERESTARTSYS;
+            goto out_unlock;
+        }
+        overwritten = aesd_commit_entry(dev, &file->working, file->working_size);
+        mutex_unlock(&dev->lock);
+        file->working_size = 0;
+
+        wake_up_interruptible(&dev->readq);
+        aesd_free_entry(dev, overwritten);
+    }
+    aesd_stat_add(dev, bytes_written, count);
+
+out_unlock:
+    mutex_unlock(&file->write_lock);
+    return retval;
+}
+
+ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+    struct iovec iov = { .iov_base = (void __user *)buf, .iov_len = count };
+    struct iov_iter iter;
+
+    PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
+
+    iov_iter_init(&iter, ITER_SOURCE, &iov, 1, count);
+    return aesd_write_from(filp->private_data, &iter);
+}
+
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    PDEBUG("write_iter %zu bytes with offset %lld", iov_iter_count(from), iocb->ki_pos);
+
+    return aesd_write_from(iocb->ki_filp->private_data, from);
+}
+
+int aesd_open(struct inode *inode, struct file *filp)
+{
+    struct aesd_file *file;
+    PDEBUG("open");
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    spin_lock_init(&file->lock);
+    mutex_init(&file->write_lock);
+    file->cursor.pos = -1;
+    filp->private_data = file;
+    return 0;
+}
+
+int aesd_release(struct inode *inode, struct file *filp)
+{
+    struct aesd_file *file = filp->private_data;
+    PDEBUG("release");
+    if (file->working_size > 0)
+        aesd_file_leave_leftover(file);
+    aesd_stage_free(&file->working);
+    kfree(file);
+    return 0;
+}
+
+static struct aesd_dev *aesd_file_dev(struct file *filp)
+{
+    return ((struct aesd_file *)filp->private_data)->dev;
+}
+
+loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
+{
+    struct aesd_dev *dev = aesd_file_dev(filp);
+    loff_t total_size;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        total_size = aesd_circular_buffer_size(&dev->buffer);
+    } while (read_seqcount_retry(&dev->seq, seq));
 
     return fixed_size_llseek(filp, off, whence, total_size);
 }
 
 static long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, unsigned int write_cmd_offset)
 {
-    struct aesd_dev *dev = filp->private_data;
+    struct aesd_dev *dev = aesd_file_dev(filp);
     long retval = 0;
-    uint8_t index;
     struct aesd_buffer_entry *entry;
-    loff_t new_pos = 0;
-    uint8_t count = 0;
+    size_t entry_start;
+    size_t entry_size = 0;
+    unsigned int seq;
 
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
-
-    // Check if write_cmd is valid
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buffer, index) {
-        if (entry->buffptr) count++;
-    }
+    // write_cmd counts from the oldest entry, the offset must fall within it
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        entry = aesd_circular_buffer_get_entry(&dev->buffer, write_cmd, &entry_start);
+        if (entry)
+            entry_size = READ_ONCE(entry->size);
+    } while (read_seqcount_retry(&dev->seq, seq));
 
-    if (write_cmd >= count) {
+    if (!entry || write_cmd_offset >= entry_size) {
         retval = -EINVAL;
-        goto out;
+    } else {
+        filp->f_pos = entry_start + write_cmd_offset;
     }
 
-    // Check if write_cmd_offset is valid within that entry
-    // We need to find the actual entry by index. SLIST? No, it's a circular buffer.
-    // The entries are from out_offs to in_offs.
-    
-    index = dev->buffer.out_offs;
-    for (uint8_t i = 0; i < write_cmd; i++) {
-        new_pos += dev->buffer.entry[index].size;
-        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    }
+    return retval;
+}
 
-    if (write_cmd_offset >= dev->buffer.entry[index].size) {
-        retval = -EINVAL;
-        goto out;
-    }
+/*
+ * Copy the ranges described by @descs into @to under one acquisition of the
+ * device lock, so all of them come from the same state of the buffer. Each
+ * descriptor's result is set to the bytes copied for it or -EINVAL.
+ */
+static ssize_t aesd_readv_locked(struct aesd_dev *dev, struct aesd_readv_desc *descs,
+                                 unsigned int nr_descs, struct iov_iter *to)
+{
+    ssize_t retval = 0;
+    unsigned int i;
+
+    if (aesd_lock(dev))
+        return -ERESTARTSYS;
 
-    new_pos += write_cmd_offset;
-    filp->f_pos = new_pos;
+    for (i = 0; i < nr_descs; i++) {
+        struct aesd_buffer_entry *entry;
+        size_t entry_start;
+        size_t entry_offset_byte;
+        size_t pos;
+        size_t left = descs[i].length;
+        size_t bytes_to_copy;
+        size_t copied;
+
+        entry = aesd_circular_buffer_get_entry(&dev->buffer, descs[i].write_cmd, &entry_start);
+        if (!entry || descs[i].write_cmd_offset >= entry->size) {
+            descs[i].result = -EINVAL;
+            continue;
+        }
+        descs[i].result = 0;
+        pos = entry_start + descs[i].write_cmd_offset;
+
+        while (left > 0 && iov_iter_count(to) > 0) {
+            entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, pos, &entry_offset_byte);
+            if (!entry)
+                break;
+
+            bytes_to_copy = min(entry->size - entry_offset_byte, left);
+            copied = copy_to_iter(entry->buffptr + entry_offset_byte, bytes_to_copy, to);
+            descs[i].result += copied;
+            retval += copied;
+            pos += copied;
+            left -= copied;
+            if (copied < bytes_to_copy) {
+                // Faulted or out of room: later ranges can't be placed either
+                if (retval == 0 && iov_iter_count(to) > 0)
+                    retval = -EFAULT;
+                goto out;
+            }
+        }
+    }
 
 out:
+    // Ranges never reached copied nothing
+    for (i++; i < nr_descs; i++)
+        descs[i].result = 0;
     mutex_unlock(&dev->lock);
     return retval;
 }
 
+static long aesd_readv(struct file *filp, struct aesd_readv __user *uarg)
+{
+    struct aesd_dev *dev = aesd_file_dev(filp);
+    struct aesd_readv args;
+    struct aesd_readv_desc *descs;
+    struct iovec iovstack[UIO_FASTIOV];
+    struct iovec *iov = iovstack;
+    struct iov_iter iter;
+    size_t descs_size;
+    long retval;
+
+    if (copy_from_user(&args, uarg, sizeof(args)))
+        return -EFAULT;
+    if (args.nr_descs == 0 || args.nr_descs > AESDCHAR_READV_MAX)
+        return -EINVAL;
+
+    descs_size = array_size(args.nr_descs, sizeof(*descs));
+    descs = memdup_user(u64_to_user_ptr(args.descs), descs_size);
+    if (IS_ERR(descs))
+        return PTR_ERR(descs);
+
+    retval = import_iovec(ITER_DEST, u64_to_user_ptr(args.iov), args.iovcnt,
+                          ARRAY_SIZE(iovstack), &iov, &iter);
+    if (retval < 0)
+        goto out_descs;
+
+    retval = aesd_readv_locked(dev, descs, args.nr_descs, &iter);
+    if (retval > 0)
+        aesd_stat_add(dev, bytes_read, retval);
+    if (retval >= 0 && copy_to_user(u64_to_user_ptr(args.descs), descs, descs_size))
+        retval = -EFAULT;
+
+    kfree(iov);
+out_descs:
+    kfree(descs);
+    return retval;
+}
+
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
+    struct aesd_dev *dev = aesd_file_dev(filp);
     long retval = 0;
     struct aesd_seekto seekto;
+    struct aesd_stats stats;
 
     if (_IOC_TYPE(cmd) != AESD_IOC_MAGIC) return -ENOTTY;
     if (_IOC_NR(cmd) > AESDCHAR_IOC_MAXNR) return -ENOTTY;
@@ -206,6 +926,14 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
                 retval = aesd_adjust_file_offset(filp, seekto.write_cmd, seekto.write_cmd_offset);
             }
             break;
+        case AESDCHAR_IOCREADV:
+            retval = aesd_readv(filp, (struct aesd_readv __user *)arg);
+            break;
+        case AESDCHAR_IOCGSTATS:
+            aesd_stats_sum(dev, &stats);
+            if (copy_to_user((struct aesd_stats __user *)arg, &stats, sizeof(stats)))
+                retval = -EFAULT;
+            break;
         default:
             retval = -ENOTTY;
     }
@@ -213,74 +941,233 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     return retval;
 }
 
+/*
+ * Readable while the file position is short of the end of the buffer.
+ * Writes never block.
+ */
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_dev *dev = aesd_file_dev(filp);
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    size_t size;
+    unsigned int seq;
+
+    poll_wait(filp, &dev->readq, wait);
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        size = aesd_circular_buffer_size(&dev->buffer);
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    if (filp->f_pos < size)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    return mask;
+}
+
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = aesd_file_dev(filp);
+
+    // The history is read-only, also refuse a later mprotect(PROT_WRITE)
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    return remap_vmalloc_range(vma, dev->arena, vma->vm_pgoff);
+}
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
     .read =     aesd_read,
+    .read_iter = aesd_read_iter,
+    .splice_read = aesd_splice_read,
     .write =    aesd_write,
+    .write_iter = aesd_write_iter,
     .open =     aesd_open,
     .release =  aesd_release,
     .llseek =   aesd_llseek,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
     dev->cdev.ops = &aesd_fops;
     err = cdev_add (&dev->cdev, devno, 1);
     if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %d", err, index);
     }
     return err;
 }
 
+static int aesd_debugfs_stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_stats stats;
+
+    aesd_stats_sum(s->private, &stats);
+    seq_printf(s, "bytes_written %llu\n", stats.bytes_written);
+    seq_printf(s, "bytes_read %llu\n", stats.bytes_read);
+    seq_printf(s, "entries_committed %llu\n", stats.entries_committed);
+    seq_printf(s, "entries_evicted %llu\n", stats.entries_evicted);
+    seq_printf(s, "lock_wait_ns %llu\n", stats.lock_wait_ns);
+    seq_printf(s, "stage_reallocs %llu\n", stats.stage_reallocs);
+    seq_printf(s, "leftover_flushes %llu\n", stats.leftover_flushes);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_debugfs_stats);
+
+/*
+ * <debugfs>/aesdchar/aesdcharN shows the counters of each minor. Like any
+ * debugfs user we carry on if it is unavailable.
+ */
+static void aesd_debugfs_init(void)
+{
+    char name[16];
+    int i;
+
+    aesd_debugfs = debugfs_create_dir("aesdchar", NULL);
+    for (i = 0; i < aesd_nr_devs; i++) {
+        snprintf(name, sizeof(name), "aesdchar%d", i);
+        debugfs_create_file(name, 0444, aesd_debugfs, &aesd_devices[i], &aesd_debugfs_stats_fops);
+    }
+}
+
+static void aesd_free_dev(struct aesd_dev *dev)
+{
+    uint8_t index;
+    struct aesd_buffer_entry *entry;
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buffer, index) {
+        aesd_free_entry(dev, entry->buffptr);
+    }
+
+    aesd_stage_free(&dev->leftover);
+    aesd_circular_buffer_release(&dev->buffer);
+    vfree(dev->arena);
+    free_percpu(dev->stats);
+}
+
+static int aesd_arena_init(struct aesd_dev *dev)
+{
+    unsigned int nr_slots = dev->buffer.nr_slots;
+
+    dev->arena_size = PAGE_ALIGN(AESD_MMAP_HEADER_SIZE + (size_t)nr_slots * aesd_mmap_slot_size);
+    dev->arena = vmalloc_user(dev->arena_size);
+    if (!dev->arena)
+        return -ENOMEM;
+
+    dev->mmap_hdr = dev->arena;
+    dev->mmap_hdr->magic = AESD_MMAP_MAGIC;
+    dev->mmap_hdr->nr_slots = nr_slots;
+    dev->mmap_hdr->slot_size = aesd_mmap_slot_size;
+    return 0;
+}
+
 int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+    int i;
+
+    if (aesd_nr_devs < 1 || aesd_nr_devs > AESD_MAX_DEVS) {
+        printk(KERN_WARNING "aesdchar: nr_devs must be 1..%d\n", AESD_MAX_DEVS);
+        return -EINVAL;
+    }
+    if (aesd_mmap_slot_size < 1 || aesd_mmap_slot_size > AESD_MMAP_SLOT_SIZE_MAX) {
+        printk(KERN_WARNING "aesdchar: mmap_slot_size must be 1..%d\n", AESD_MMAP_SLOT_SIZE_MAX);
+        return -EINVAL;
+    }
+
+    // Slots go up to 1 MiB, stages beyond a page come from kvmalloc()
+    aesd_stage_cache_size = min_t(size_t, aesd_mmap_slot_size, PAGE_SIZE);
+    aesd_stage_cache = kmem_cache_create("aesdchar_stage", aesd_stage_cache_size, 0, 0, NULL);
+    if (!aesd_stage_cache)
+        return -ENOMEM;
+
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
+        kmem_cache_destroy(aesd_stage_cache);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
 
-    mutex_init(&aesd_device.lock);
-    aesd_circular_buffer_init(&aesd_device.buffer);
+    aesd_devices = kcalloc(aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (!aesd_devices) {
+        result = -ENOMEM;
+        goto fail_region;
+    }
 
-    result = aesd_setup_cdev(&aesd_device);
+    for (i = 0; i < aesd_nr_devs; i++) {
+        mutex_init(&aesd_devices[i].lock);
+        seqcount_mutex_init(&aesd_devices[i].seq, &aesd_devices[i].lock);
+        init_waitqueue_head(&aesd_devices[i].readq);
+        aesd_devices[i].stats = alloc_percpu(struct aesd_stats);
+        if (!aesd_devices[i].stats) {
+            result = -ENOMEM;
+            goto fail_buffer;
+        }
+        result = aesd_circular_buffer_init_capacity(&aesd_devices[i].buffer, aesd_capacity);
+        if (result) {
+            printk(KERN_WARNING "aesdchar: capacity must be 1..%d\n", AESDCHAR_MAX_CAPACITY);
+            free_percpu(aesd_devices[i].stats);
+            goto fail_buffer;
+        }
+        result = aesd_arena_init(&aesd_devices[i]);
+        if (result) {
+            aesd_circular_buffer_release(&aesd_devices[i].buffer);
+            free_percpu(aesd_devices[i].stats);
+            goto fail_buffer;
+        }
+    }
 
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
+    for (i = 0; i < aesd_nr_devs; i++) {
+        result = aesd_setup_cdev(&aesd_devices[i], i);
+        if (result)
+            goto fail_cdev;
     }
+    aesd_debugfs_init();
+    return 0;
+
+fail_cdev:
+    while (--i >= 0)
+        cdev_del(&aesd_devices[i].cdev);
+    i = aesd_nr_devs;
+fail_buffer:
+    while (--i >= 0)
+        aesd_free_dev(&aesd_devices[i]);
+    kfree(aesd_devices);
+fail_region:
+    unregister_chrdev_region(dev, aesd_nr_devs);
+    kmem_cache_destroy(aesd_stage_cache);
     return result;
 
 }
 
 void aesd_cleanup_module(void)
 {
-    uint8_t index;
-    struct aesd_buffer_entry *entry;
     dev_t devno = MKDEV(aesd_major, aesd_minor);
+    int i;
 
-    cdev_del(&aesd_device.cdev);
-
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buffer, index) {
-        if (entry->buffptr) {
-            kfree(entry->buffptr);
-        }
-    }
-    
-    if (aesd_device.working_entry.buffptr) {
-        kfree(aesd_device.working_entry.buffptr);
+    debugfs_remove_recursive(aesd_debugfs);
+    for (i = 0; i < aesd_nr_devs; i++) {
+        cdev_del(&aesd_devices[i].cdev);
+        aesd_free_dev(&aesd_devices[i]);
     }
+    kfree(aesd_devices);
+    kmem_cache_destroy(aesd_stage_cache);
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 module_init(aesd_init_module);
@@ -0,0 +1,467 @@
+/*
+ * aesdbench.c
+ *
+ * Load generator for aesdsocket. Opens a number of connections to the server,
+ * sends newline terminated packets of a configurable size distribution,
+ * mixes in AESDCHAR_IOCSEEKTO commands and reports throughput and round trip
+ * latency percentiles as text and optionally JSON.
+ *
+ * Every reply of aesdsocket is a dump of the stored data ending with the
+ * packet just written, so a data packet completes once the received stream
+ * ends with the packet's own unique payload. A seek command has no such
+ * marker (and no reply at all in file mode), so it is sent pipelined with a
+ * data packet and the pair completes once that packet is echoed back. This
+ * relies on the server framing every line of a receive buffer separately.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define DEFAULT_PORT "9000"
+#define RECV_BUF_SIZE (64 * 1024)
+#define MIN_PACKET_SIZE 48
+
+enum size_dist_kind {
+    SIZE_FIXED,
+    SIZE_UNIFORM,
+    SIZE_EXP,
+};
+
+struct size_dist {
+    enum size_dist_kind kind;
+    size_t a;  // fixed size, uniform minimum or exponential mean
+    size_t b;  // uniform maximum
+};
+
+struct bench_config {
+    const char *host;
+    const char *port;
+    int nr_threads;
+    int nr_conns;
+    long packets_per_conn;
+    int seek_percent;
+    unsigned int seek_max_cmd;
+    struct size_dist sizes;
+    const char *json_path;
+    unsigned int seed;
+    int timeout_ms;
+};
+
+struct bench_conn {
+    int fd;
+    int id;
+    long sent;
+};
+
+struct bench_thread {
+    pthread_t thread_id;
+    int id;
+    const struct bench_config *cfg;
+    struct bench_conn *conns;
+    int nr_conns;
+    unsigned int rand_state;
+    // Latency samples in nanoseconds, one per completed operation
+    uint64_t *latencies;
+    size_t nr_latencies;
+    uint64_t nr_seeks;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t errors;
+    char *packet;
+    char *recv_buf;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int parse_size_dist(const char *spec, struct size_dist *dist) {
+    unsigned long a, b;
+
+    if (sscanf(spec, "fixed:%lu", &a) == 1) {
+        dist->kind = SIZE_FIXED;
+        dist->a = a;
+    } else if (sscanf(spec, "uniform:%lu:%lu", &a, &b) == 2 && a <= b) {
+        dist->kind = SIZE_UNIFORM;
+        dist->a = a;
+        dist->b = b;
+    } else if (sscanf(spec, "exp:%lu", &a) == 1 && a > 0) {
+        dist->kind = SIZE_EXP;
+        dist->a = a;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static size_t next_packet_size(struct bench_thread *thread) {
+    const struct size_dist *dist = &thread->cfg->sizes;
+    size_t size;
+
+    switch (dist->kind) {
+        case SIZE_UNIFORM:
+            size = dist->a + rand_r(&thread->rand_state) % (dist->b - dist->a + 1);
+            break;
+        case SIZE_EXP: {
+            double u = (rand_r(&thread->rand_state) + 1.0) / ((double)RAND_MAX + 2.0);
+            size = (size_t)(-log(u) * dist->a);
+            if (size > dist->b) size = dist->b;
+            break;
+        }
+        case SIZE_FIXED:
+        default:
+            size = dist->a;
+            break;
+    }
+    // Room for the unique header that identifies the echo of this packet
+    return size < MIN_PACKET_SIZE ? MIN_PACKET_SIZE : size;
+}
+
+static int connect_to_server(const struct bench_config *cfg) {
+    struct addrinfo hints, *res, *ai;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(cfg->host, cfg->port, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+        return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd == -1) {
+        perror("connect");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // A reply that never ends in its marker becomes an error instead of a hang
+    struct timeval tv = { .tv_sec = cfg->timeout_ms / 1000, .tv_usec = (cfg->timeout_ms % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * Receive until the stream ends with @param marker of @param marker_len bytes.
+ * @return number of bytes received, -1 on error or early close
+ */
+static ssize_t recv_until_marker(struct bench_thread *thread, int fd, const char *marker, size_t marker_len) {
+    size_t total = 0;
+    size_t tail_len = 0;
+    char *tail = thread->recv_buf + RECV_BUF_SIZE;  // last marker_len bytes seen
+
+    for (;;) {
+        ssize_t n = recv(fd, thread->recv_buf, RECV_BUF_SIZE, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) return -1;
+        total += n;
+
+        if ((size_t)n >= marker_len) {
+            memcpy(tail, thread->recv_buf + n - marker_len, marker_len);
+            tail_len = marker_len;
+        } else {
+            size_t keep = tail_len + n > marker_len ? marker_len - n : tail_len;
+            memmove(tail, tail + tail_len - keep, keep);
+            memcpy(tail + keep, thread->recv_buf, n);
+            tail_len = keep + n;
+        }
+        if (tail_len == marker_len && memcmp(tail, marker, marker_len) == 0) {
+            return total;
+        }
+    }
+}
+
+/**
+ * Build a data packet whose header makes it unique across the whole run
+ * @return length of the packet including the trailing newline
+ */
+static size_t build_packet(struct bench_thread *thread, struct bench_conn *conn, size_t size) {
+    int hdr = snprintf(thread->packet, size, "aesdbench t%d c%d s%ld ", thread->id, conn->id, conn->sent);
+    for (size_t i = hdr; i < size - 1; i++) {
+        thread->packet[i] = 'a' + (i % 26);
+    }
+    thread->packet[size - 1] = '\n';
+    return size;
+}
+
+static int run_operation(struct bench_thread *thread, struct bench_conn *conn) {
+    const struct bench_config *cfg = thread->cfg;
+    char seek_cmd[64];
+    size_t seek_len = 0;
+
+    if (cfg->seek_percent > 0 && (int)(rand_r(&thread->rand_state) % 100) < cfg->seek_percent) {
+        seek_len = snprintf(seek_cmd, sizeof(seek_cmd), "AESDCHAR_IOCSEEKTO:%u,0\n",
+                            rand_r(&thread->rand_state) % (cfg->seek_max_cmd + 1));
+    }
+    size_t len = build_packet(thread, conn, next_packet_size(thread));
+
+    uint64_t start = now_ns();
+    if ((seek_len && send_all(conn->fd, seek_cmd, seek_len) == -1) ||
+        send_all(conn->fd, thread->packet, len) == -1) {
+        return -1;
+    }
+    ssize_t received = recv_until_marker(thread, conn->fd, thread->packet, len);
+    if (received < 0) {
+        return -1;
+    }
+    thread->latencies[thread->nr_latencies++] = now_ns() - start;
+
+    thread->bytes_sent += len + seek_len;
+    thread->bytes_received += received;
+    if (seek_len) thread->nr_seeks++;
+    conn->sent++;
+    return 0;
+}
+
+static void* bench_thread_func(void* arg) {
+    struct bench_thread *thread = arg;
+    const struct bench_config *cfg = thread->cfg;
+    bool active = true;
+
+    while (active) {
+        active = false;
+        for (int i = 0; i < thread->nr_conns; i++) {
+            struct bench_conn *conn = &thread->conns[i];
+            if (conn->fd == -1 || conn->sent >= cfg->packets_per_conn) continue;
+            active = true;
+            if (run_operation(thread, conn) == -1) {
+                fprintf(stderr, "connection %d failed: %s\n", conn->id, strerror(errno));
+                thread->errors++;
+                close(conn->fd);
+                conn->fd = -1;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, double p) {
+    if (n == 0) return 0.0;
+    size_t index = (size_t)ceil(p * n) - 1;
+    if (index >= n) index = n - 1;
+    return sorted[index] / 1000.0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "  -H host     server address (default 127.0.0.1)\n");
+    fprintf(stderr, "  -p port     server port (default %s)\n", DEFAULT_PORT);
+    fprintf(stderr, "  -c conns    number of connections (default 8)\n");
+    fprintf(stderr, "  -t threads  number of client threads (default 4)\n");
+    fprintf(stderr, "  -n packets  packets per connection (default 100)\n");
+    fprintf(stderr, "  -s dist     packet sizes: fixed:N, uniform:MIN:MAX or exp:MEAN (default fixed:64)\n");
+    fprintf(stderr, "  -k percent  share of packets preceded by AESDCHAR_IOCSEEKTO (default 0)\n");
+    fprintf(stderr, "  -m cmd      highest write_cmd used by seek commands (default 9)\n");
+    fprintf(stderr, "  -j file     also write results as JSON to file, - for stdout\n");
+    fprintf(stderr, "  -r seed     random seed (default 1)\n");
+    fprintf(stderr, "  -T ms       reply timeout before a connection counts as failed (default 5000)\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_config cfg = {
+        .host = "127.0.0.1",
+        .port = DEFAULT_PORT,
+        .nr_threads = 4,
+        .nr_conns = 8,
+        .packets_per_conn = 100,
+        .seek_percent = 0,
+        .seek_max_cmd = 9,
+        .sizes = { .kind = SIZE_FIXED, .a = 64 },
+        .json_path = NULL,
+        .seed = 1,
+        .timeout_ms = 5000,
+    };
+    int opt_char;
+
+    while ((opt_char = getopt(argc, argv, "H:p:c:t:n:s:k:m:j:r:T:h")) != -1) {
+        switch (opt_char) {
+            case 'H': cfg.host = optarg; break;
+            case 'p': cfg.port = optarg; break;
+            case 'c': cfg.nr_conns = atoi(optarg); break;
+            case 't': cfg.nr_threads = atoi(optarg); break;
+            case 'n': cfg.packets_per_conn = atol(optarg); break;
+            case 'k': cfg.seek_percent = atoi(optarg); break;
+            case 'm': cfg.seek_max_cmd = strtoul(optarg, NULL, 10); break;
+            case 'j': cfg.json_path = optarg; break;
+            case 'r': cfg.seed = strtoul(optarg, NULL, 10); break;
+            case 'T': cfg.timeout_ms = atoi(optarg); break;
+            case 's':
+                if (parse_size_dist(optarg, &cfg.sizes) == -1) {
+                    fprintf(stderr, "invalid size distribution '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return opt_char == 'h' ? 0 : 1;
+        }
+    }
+    if (cfg.nr_conns <= 0 || cfg.nr_threads <= 0 || cfg.packets_per_conn <= 0 ||
+        cfg.seek_percent < 0 || cfg.seek_percent > 100 || cfg.timeout_ms <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (cfg.nr_threads > cfg.nr_conns) cfg.nr_threads = cfg.nr_conns;
+
+    size_t packet_cap = MIN_PACKET_SIZE;
+    if (cfg.sizes.kind == SIZE_FIXED && cfg.sizes.a > packet_cap) packet_cap = cfg.sizes.a;
+    if (cfg.sizes.kind == SIZE_UNIFORM && cfg.sizes.b > packet_cap) packet_cap = cfg.sizes.b;
+    if (cfg.sizes.kind == SIZE_EXP) {
+        // The exponential tail is unbounded: cap it at 64 times the mean
+        packet_cap = cfg.sizes.a * 64 + MIN_PACKET_SIZE;
+        cfg.sizes.b = packet_cap;
+    }
+
+    struct bench_thread *threads = calloc(cfg.nr_threads, sizeof(struct bench_thread));
+    struct bench_conn *conns = calloc(cfg.nr_conns, sizeof(struct bench_conn));
+    if (!threads || !conns) {
+        perror("calloc");
+        return 1;
+    }
+
+    for (int i = 0; i < cfg.nr_conns; i++) {
+        conns[i].id = i;
+        conns[i].fd = connect_to_server(&cfg);
+        if (conns[i].fd == -1) return 1;
+    }
+
+    // Connections are split evenly, the first threads take the remainder
+    int next_conn = 0;
+    for (int i = 0; i < cfg.nr_threads; i++) {
+        struct bench_thread *thread = &threads[i];
+        thread->id = i;
+        thread->cfg = &cfg;
+        thread->rand_state = cfg.seed + i;
+        thread->nr_conns = cfg.nr_conns / cfg.nr_threads + (i < cfg.nr_conns % cfg.nr_threads);
+        thread->conns = &conns[next_conn];
+        next_conn += thread->nr_conns;
+        thread->latencies = calloc(thread->nr_conns * cfg.packets_per_conn, sizeof(uint64_t));
+        thread->packet = malloc(packet_cap);
+        thread->recv_buf = malloc(RECV_BUF_SIZE + packet_cap);
+        if (!thread->latencies || !thread->packet || !thread->recv_buf) {
+            perror("malloc");
+            return 1;
+        }
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < cfg.nr_threads; i++) {
+        if (pthread_create(&threads[i].thread_id, NULL, bench_thread_func, &threads[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    for (int i = 0; i < cfg.nr_threads; i++) {
+        pthread_join(threads[i].thread_id, NULL);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    size_t nr_ops = 0;
+    uint64_t nr_seeks = 0, bytes_sent = 0, bytes_received = 0, errors = 0;
+    for (int i = 0; i < cfg.nr_threads; i++) {
+        nr_ops += threads[i].nr_latencies;
+        nr_seeks += threads[i].nr_seeks;
+        bytes_sent += threads[i].bytes_sent;
+        bytes_received += threads[i].bytes_received;
+        errors += threads[i].errors;
+    }
+    uint64_t *all = malloc((nr_ops ? nr_ops : 1) * sizeof(uint64_t));
+    if (!all) {
+        perror("malloc");
+        return 1;
+    }
+    size_t pos = 0;
+    for (int i = 0; i < cfg.nr_threads; i++) {
+        memcpy(all + pos, threads[i].latencies, threads[i].nr_latencies * sizeof(uint64_t));
+        pos += threads[i].nr_latencies;
+    }
+    qsort(all, nr_ops, sizeof(uint64_t), compare_u64);
+
+    double p50 = percentile_us(all, nr_ops, 0.50);
+    double p99 = percentile_us(all, nr_ops, 0.99);
+    double p999 = percentile_us(all, nr_ops, 0.999);
+    double max = nr_ops ? all[nr_ops - 1] / 1000.0 : 0.0;
+    double ops_per_sec = elapsed > 0 ? nr_ops / elapsed : 0.0;
+
+    printf("connections:   %d (%d threads)\n", cfg.nr_conns, cfg.nr_threads);
+    printf("operations:    %zu (%llu with seek), %llu errors\n", nr_ops,
+           (unsigned long long)nr_seeks, (unsigned long long)errors);
+    printf("elapsed:       %.3f s\n", elapsed);
+    printf("throughput:    %.1f ops/s, %.2f MiB/s sent, %.2f MiB/s received\n", ops_per_sec,
+           bytes_sent / elapsed / (1024 * 1024), bytes_received / elapsed / (1024 * 1024));
+    printf("latency (us):  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n", p50, p99, p999, max);
+
+    if (cfg.json_path) {
+        FILE *out = strcmp(cfg.json_path, "-") == 0 ? stdout : fopen(cfg.json_path, "w");
+        if (!out) {
+            perror(cfg.json_path);
+            return 1;
+        }
+        fprintf(out, "{\"connections\": %d, \"threads\": %d, \"operations\": %zu, \"seeks\": %llu, "
+                "\"errors\": %llu, \"elapsed_s\": %.6f, \"ops_per_s\": %.3f, \"bytes_sent\": %llu, "
+                "\"bytes_received\": %llu, \"latency_us\": {\"p50\": %.3f, \"p99\": %.3f, "
+                "\"p999\": %.3f, \"max\": %.3f}}\n",
+                cfg.nr_conns, cfg.nr_threads, nr_ops, (unsigned long long)nr_seeks,
+                (unsigned long long)errors, elapsed, ops_per_sec, (unsigned long long)bytes_sent,
+                (unsigned long long)bytes_received, p50, p99, p999, max);
+        if (out != stdout) fclose(out);
+    }
+
+    for (int i = 0; i < cfg.nr_conns; i++) {
+        if (conns[i].fd != -1) close(conns[i].fd);
+    }
+    for (int i = 0; i < cfg.nr_threads; i++) {
+        free(threads[i].latencies);
+        free(threads[i].packet);
+        free(threads[i].recv_buf);
+    }
+    free(all);
+    free(threads);
+    free(conns);
+    return errors ? 2 : 0;
+}
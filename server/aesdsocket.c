@@ -13,37 +13,67 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include <sys/queue.h>
+#include <poll.h>
 #include <time.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/timerfd.h>
+#include <stdatomic.h>
 #include "../aesd-char-driver/aesd_ioctl.h"
-
-#define PORT 9000
-#define BACKLOG 10
-#define BUFFER_SIZE 1024
-
-#ifndef USE_AESD_CHAR_DEVICE
-#define USE_AESD_CHAR_DEVICE 1
+#include "aesdsocket.h"
+#include "uring.h"
+#include "rxbuf.h"
+#include "framing.h"
+#include "segstore.h"
+#include "pool.h"
+#include "txbuf.h"
+
+/**
+ * Client served by the worker pool. The task is the first member, the pool
+ * hands it back as a pointer to the connection.
+ */
+struct client_conn {
+    struct pool_task task;
+    int shard;
+    struct rx_packet packet;
+    struct tx_queue out;  // replies the socket has not taken yet
+#if USE_IO_URING
+    struct uring_client *uc;  // NULL when served with plain recv()/send()
 #endif
-
-#if USE_AESD_CHAR_DEVICE
-#define DATA_FILE "/dev/aesdchar"
-#else
-#define DATA_FILE "/var/tmp/aesdsocketdata"
-#endif
-
-// Thread data structure
-struct thread_data_s {
-    pthread_t thread_id;
-    int client_fd;
-    bool thread_complete;
-    SLIST_ENTRY(thread_data_s) entries;
+    LIST_ENTRY(client_conn) entries;
 };
 
 // Global variables
 int server_fd = -1;
 volatile sig_atomic_t keep_running = 1;
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
-SLIST_HEAD(slisthead, thread_data_s) head;
+// Connections accepted and not reaped yet, only touched by main()
+static LIST_HEAD(client_list, client_conn) clients = LIST_HEAD_INITIALIZER(clients);
+int nr_shards = 1;
+struct ringstore *ring_stores;
+#if USE_AESD_CHAR_DEVICE
+enum data_backend data_backend = BACKEND_DEVICE;
+struct shard shards[MAX_SHARDS];
+#else
+enum data_backend data_backend = BACKEND_FILE;
+struct store data_store;
+struct segstore seg_store;
+
+/**
+ * Append one record to the selected backend
+ * @param end_rtn receives the length of the data once the record is in,
+ * the ring has no such length and leaves it alone
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int data_appendv(const struct iovec *iov, int iovcnt, size_t len, off_t *end_rtn) {
+    if (data_backend == BACKEND_RING) {
+        return ringstore_appendv(&ring_stores[0], iov, iovcnt, len, NULL, NULL);
+    }
+    if (data_backend == BACKEND_SEGMENT) {
+        return segstore_appendv(&seg_store, iov, iovcnt, len, end_rtn);
+    }
+    return store_appendv(&data_store, iov, iovcnt, len, end_rtn);
+}
+#endif
 
 void handle_signal(int sig) {
     if (sig == SIGINT || sig == SIGTERM) {
@@ -52,6 +82,8 @@ void handle_signal(int sig) {
         if (server_fd != -1) {
             shutdown(server_fd, SHUT_RDWR);
         }
+        evloop_stop();
+        pool_stop();
     }
 }
 
@@ -89,140 +121,559 @@ void daemonize() {
 }
 
 #if !USE_AESD_CHAR_DEVICE
-void* timer_thread_func(void* arg) {
-    while (keep_running) {
-        for(int i=0; i<10; i++) {
-             if(!keep_running) break;
-             sleep(1); 
+int timestamp_fd = -1;
+
+static int timestamp_open(void) {
+    struct itimerspec its = {
+        .it_interval = { .tv_sec = TIMESTAMP_INTERVAL_S },
+        .it_value = { .tv_sec = TIMESTAMP_INTERVAL_S },
+    };
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (timerfd_settime(fd, 0, &its, NULL) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void timestamp_expired(void) {
+    uint64_t expirations;
+
+    // Several loops may poll the timer, only the one that reads it writes
+    if (read(timestamp_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+
+    char buffer[100];
+    time_t now = time(NULL);
+    struct tm info;
+    localtime_r(&now, &info);
+    size_t len = strftime(buffer, sizeof(buffer), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", &info);
+
+    // One record however many intervals were missed
+    struct iovec iov = { .iov_base = buffer, .iov_len = len };
+    if (data_appendv(&iov, 1, iov.iov_len, NULL) == -1) {
+        syslog(LOG_ERR, "timestamp append failed: %s", strerror(errno));
+    }
+}
+
+static void timestamp_task_run(struct pool_task *task, struct rx_pool *pool) {
+    (void)pool;
+    timestamp_expired();
+    if (pool_rearm(task) == -1) {
+        perror("epoll_ctl");
+    }
+}
+
+static struct pool_task timestamp_task = { .run = timestamp_task_run };
+#endif
+
+bool parse_seekto(const struct iovec *iov, int iovcnt, size_t packet_len, struct aesd_seekto *seekto) {
+    const char *ioctl_str = "AESDCHAR_IOCSEEKTO:";
+    unsigned int write_cmd, write_cmd_offset;
+    // Commands are short: only their start is flattened for parsing
+    char packet[SEEKTO_PARSE_MAX + 1];
+
+    if (packet_len <= strlen(ioctl_str)) {
+        return false;
+    }
+    packet[iov_copy_prefix(iov, iovcnt, packet, SEEKTO_PARSE_MAX)] = '\0';
+    if (strncmp(packet, ioctl_str, strlen(ioctl_str)) != 0) {
+        return false;
+    }
+    if (sscanf(packet + strlen(ioctl_str), "%u,%u", &write_cmd, &write_cmd_offset) != 2) {
+        return false;
+    }
+    seekto->write_cmd = write_cmd;
+    seekto->write_cmd_offset = write_cmd_offset;
+    return true;
+}
+
+int shard_for_addr(uint32_t addr, uint16_t port) {
+    // Fibonacci hashing, the high bits of the product pick the shard
+    uint64_t key = ((uint64_t)ntohl(addr) << 16) | ntohs(port);
+    uint32_t hash = (key * 0x9e3779b97f4a7c15ull) >> 32;
+    return ((uint64_t)hash * nr_shards) >> 32;
+}
+
+int parse_readv(const struct iovec *iov, int iovcnt, size_t packet_len, struct aesd_readv_desc *descs) {
+    const char *ioctl_str = "AESDCHAR_IOCREADV:";
+    char packet[READV_PARSE_MAX + 1];
+    char *p;
+    int nr_descs = 0;
+
+    if (packet_len <= strlen(ioctl_str) || packet_len > READV_PARSE_MAX) {
+        return 0;
+    }
+    packet[iov_copy_prefix(iov, iovcnt, packet, READV_PARSE_MAX)] = '\0';
+    if (strncmp(packet, ioctl_str, strlen(ioctl_str)) != 0) {
+        return 0;
+    }
+    p = packet + strlen(ioctl_str);
+    for (;;) {
+        unsigned int write_cmd, write_cmd_offset, length;
+        int consumed;
+
+        if (nr_descs == AESDCHAR_READV_MAX ||
+            sscanf(p, "%u,%u,%u%n", &write_cmd, &write_cmd_offset, &length, &consumed) != 3) {
+            return 0;
+        }
+        descs[nr_descs].write_cmd = write_cmd;
+        descs[nr_descs].write_cmd_offset = write_cmd_offset;
+        descs[nr_descs].length = length;
+        descs[nr_descs].result = 0;
+        nr_descs++;
+        p += consumed;
+        if (*p != ';') break;
+        p++;
+    }
+    return nr_descs;
+}
+
+// Fetch all ranges of an AESDCHAR_IOCREADV command with a single ioctl and
+// reply with their data back to back
+static void run_readv(int fd, struct aesd_readv_desc *descs, int nr_descs,
+                      const struct reply_ops *reply, void *ctx) {
+    size_t total = 0;
+    for (int i = 0; i < nr_descs; i++) {
+        total += descs[i].length;
+    }
+    if (total > READV_REPLY_MAX) total = READV_REPLY_MAX;
+    if (total == 0) return;
+
+    char *buf = malloc(total);
+    if (!buf) {
+        syslog(LOG_ERR, "readv buffer: %s", strerror(errno));
+        return;
+    }
+    struct iovec iov = { .iov_base = buf, .iov_len = total };
+    struct aesd_readv args = {
+        .descs = (uintptr_t)descs,
+        .iov = (uintptr_t)&iov,
+        .nr_descs = nr_descs,
+        .iovcnt = 1,
+    };
+    int rc = ioctl(fd, AESDCHAR_IOCREADV, &args);
+    if (rc > 0) {
+        reply->data(ctx, buf, rc);
+    } else if (rc < 0) {
+        syslog(LOG_ERR, "ioctl failed: %s", strerror(errno));
+    }
+    free(buf);
+}
+
+// process_packet() for -b ring, the ring of @param shard stands in for the device
+static void process_packet_ring(const struct iovec *iov, int iovcnt, size_t packet_len, int shard,
+                                const struct reply_ops *reply, void *ctx) {
+    struct ringstore *ring = &ring_stores[shard];
+    struct aesd_seekto seekto;
+    struct aesd_readv_desc descs[AESDCHAR_READV_MAX];
+    int nr_descs;
+
+    if (parse_seekto(iov, iovcnt, packet_len, &seekto)) {
+        if (ringstore_seekto(ring, &seekto, reply, ctx) == -1) {
+            syslog(LOG_ERR, "ioctl failed: %s", strerror(errno));
         }
-        if (!keep_running) break;
+    } else if ((nr_descs = parse_readv(iov, iovcnt, packet_len, descs)) > 0) {
+        if (ringstore_readv(ring, descs, nr_descs, reply, ctx) == -1) {
+            syslog(LOG_ERR, "ioctl failed: %s", strerror(errno));
+        }
+    } else if (ringstore_appendv(ring, iov, iovcnt, packet_len, reply, ctx) == -1) {
+        syslog(LOG_ERR, "append failed: %s", strerror(errno));
+    }
+}
 
-        time_t rawtime;
-        struct tm *info;
-        char buffer[100];
+/**
+ * Pass everything @param fd holds from its current position on to @param
+ * reply. Replies with a device hook get what they take through sendfile(),
+ * which the driver serves by copying its entries once into pages handed to
+ * the socket; the rest is read into a buffer. Should the driver lack splice
+ * support, the first attempt says so and from then on the device is read.
+ */
+void reply_rest(int fd, const struct reply_ops *reply, void *ctx) {
+    static _Atomic bool no_splice;
+    char send_buf[DEVICE_READ_SIZE];
+    ssize_t read_bytes;
+    ssize_t sent;
+    off_t pos, end;
+
+    if (reply->device && !atomic_load(&no_splice) &&
+        (pos = lseek(fd, 0, SEEK_CUR)) != -1 && (end = lseek(fd, 0, SEEK_END)) != -1) {
+        if (end <= pos) {
+            return;
+        }
+        sent = reply->device(ctx, fd, pos, end - pos);
+        if (sent < 0) {
+            if (errno != EINVAL && errno != ENOSYS) {
+                return;
+            }
+            if (!atomic_exchange(&no_splice, true)) {
+                syslog(LOG_WARNING, "sendfile from the device unsupported, reading it instead");
+            }
+            sent = 0;
+        }
+        if (sent == end - pos) {
+            return;
+        }
+        lseek(fd, pos + sent, SEEK_SET);
+    }
+
+    while ((read_bytes = read(fd, send_buf, sizeof(send_buf))) > 0) {
+        if (reply->data(ctx, send_buf, read_bytes) != 0) break;
+    }
+}
 
-        time(&rawtime);
-        info = localtime(&rawtime);
+void process_packet(const struct iovec *iov, int iovcnt, size_t packet_len, int shard,
+                    const struct reply_ops *reply, void *ctx) {
+    if (data_backend == BACKEND_RING) {
+        process_packet_ring(iov, iovcnt, packet_len, shard, reply, ctx);
+        return;
+    }
 
-        strftime(buffer, sizeof(buffer), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", info);
+#if USE_AESD_CHAR_DEVICE
+    const char *path = shards[shard].path;
+    pthread_mutex_lock(&shards[shard].lock);
+#endif
 
-        pthread_mutex_lock(&file_mutex);
-        int fd = open(DATA_FILE, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    bool is_ioctl = false;
+    struct aesd_seekto seekto;
+    struct aesd_readv_desc descs[AESDCHAR_READV_MAX];
+    int nr_descs;
+    if (parse_seekto(iov, iovcnt, packet_len, &seekto)) {
+        is_ioctl = true;
+#if USE_AESD_CHAR_DEVICE
+        // O_NONBLOCK: read up to the end even if the driver was loaded with follow=1
+        int fd = open(path, O_RDWR | O_NONBLOCK);
+#else
+        int fd = open(DATA_FILE, O_RDWR);
+#endif
         if (fd != -1) {
-            write(fd, buffer, strlen(buffer));
+            if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) == 0) {
+                // After ioctl, send the remainder of the file
+                reply_rest(fd, reply, ctx);
+            } else {
+                syslog(LOG_ERR, "ioctl failed: %s", strerror(errno));
+            }
+            close(fd);
+        }
+    } else if ((nr_descs = parse_readv(iov, iovcnt, packet_len, descs)) > 0) {
+        is_ioctl = true;
+#if USE_AESD_CHAR_DEVICE
+        int fd = open(path, O_RDONLY);
+#else
+        int fd = open(DATA_FILE, O_RDONLY);
+#endif
+        if (fd != -1) {
+            run_readv(fd, descs, nr_descs, reply, ctx);
             close(fd);
         }
-        pthread_mutex_unlock(&file_mutex);
     }
-    return NULL;
-}
+
+    if (!is_ioctl) {
+#if USE_AESD_CHAR_DEVICE
+        int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+        if (fd != -1) {
+            // A batch of pipelined lines still becomes one entry per line
+            iov_write_lines(fd, iov, iovcnt);
+            close(fd);
+        }
+
+        fd = open(path, O_RDONLY | O_NONBLOCK);
+        if (fd != -1) {
+            reply_rest(fd, reply, ctx);
+            close(fd);
+        }
+#else
+        // The reply covers everything committed up to and including this
+        // packet, exactly what the file held when a global lock serialized
+        // append and readback. No lock is held while it is streamed.
+        // A failed append gets no reply, the client sees the connection
+        // carry on without its echo
+        off_t end;
+        if (data_appendv(iov, iovcnt, packet_len, &end) == -1) {
+            syslog(LOG_ERR, "append failed: %s", strerror(errno));
+            end = 0;
+        }
+        if (end > 0 && data_backend == BACKEND_SEGMENT) {
+            segstore_reply(&seg_store, end, reply, ctx);
+        } else if (end > 0) {
+            reply->file(ctx, data_store.fd, 0, end);
+        }
+#endif
+    }
+
+#if USE_AESD_CHAR_DEVICE
+    pthread_mutex_unlock(&shards[shard].lock);
 #endif
+}
+
+static int client_handle_lines(const struct iovec *iov, int iovcnt, size_t len, int nr_lines, void *ctx) {
+    struct client_conn *conn = ctx;
+    (void)nr_lines;
+    process_packet(iov, iovcnt, len, conn->shard, &tx_queue_reply, &conn->out);
+    return 0;
+}
 
-void* client_thread_func(void* thread_param) {
-    struct thread_data_s* data = (struct thread_data_s*)thread_param;
-    char buffer[BUFFER_SIZE];
+/**
+ * Pool task: receive whatever the client has sent, without waiting, and
+ * handle its complete lines. Their replies are queued and sent as far as the
+ * socket takes them; while some are left the task waits for the socket to
+ * turn writable instead of reading on. Once the client is done its buffers
+ * are released here, where the chunk pool is at hand, and main() closes the
+ * socket when it reaps it.
+ */
+static void client_task_run(struct pool_task *task, struct rx_pool *pool) {
+    struct client_conn *conn = (struct client_conn *)task;
     ssize_t bytes_received;
-    char* full_packet = NULL;
-    size_t packet_len = 0;
+    int rc;
 
     while (keep_running) {
-        bytes_received = recv(data->client_fd, buffer, BUFFER_SIZE, 0);
-        if (bytes_received < 0) {
-            if (keep_running) perror("recv");
+        // Run for EPOLLOUT, or the last packet's reply filled the socket
+        rc = tx_queue_flush(&conn->out);
+        if (rc < 0) {
             break;
         }
-        if (bytes_received == 0) {
-            break; // Connection closed
+        if (rc == 0) {
+            if (pool_rearm_writable(task) == 0) return;
+            perror("epoll_ctl");
+            break;
         }
 
-        char* new_packet = realloc(full_packet, packet_len + bytes_received + 1);
-        if (!new_packet) {
-            perror("realloc");
-            free(full_packet);
-            full_packet = NULL;
+#if USE_IO_URING
+        if (conn->uc) {
+            bytes_received = uring_client_recv(conn->uc, &conn->packet, pool);
+            if (bytes_received > 0) continue;
+            if (bytes_received < 0) {
+                if (pool_rearm(task) == 0) return;
+                perror("epoll_ctl");
+            }
             break;
         }
-        full_packet = new_packet;
-        memcpy(full_packet + packet_len, buffer, bytes_received);
-        packet_len += bytes_received;
-        full_packet[packet_len] = '\0';
-
-        if (memchr(buffer, '\n', bytes_received)) {
-            pthread_mutex_lock(&file_mutex);
-            
-            bool is_ioctl = false;
-            const char *ioctl_str = "AESDCHAR_IOCSEEKTO:";
-            if (strncmp(full_packet, ioctl_str, strlen(ioctl_str)) == 0) {
-                unsigned int write_cmd, write_cmd_offset;
-                if (sscanf(full_packet + strlen(ioctl_str), "%u,%u", &write_cmd, &write_cmd_offset) == 2) {
-                    is_ioctl = true;
-                    int fd = open(DATA_FILE, O_RDWR);
-                    if (fd != -1) {
-                        struct aesd_seekto seekto;
-                        seekto.write_cmd = write_cmd;
-                        seekto.write_cmd_offset = write_cmd_offset;
-                        if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) == 0) {
-                            // After ioctl, read remainder of file and send
-                            char send_buf[BUFFER_SIZE];
-                            ssize_t read_bytes;
-                            while ((read_bytes = read(fd, send_buf, BUFFER_SIZE)) > 0) {
-                                send(data->client_fd, send_buf, read_bytes, 0);
-                            }
-                        } else {
-                            syslog(LOG_ERR, "ioctl failed: %s", strerror(errno));
-                        }
-                        close(fd);
-                    }
-                }
-            }
+#endif
 
-            if (!is_ioctl) {
-                int fd = open(DATA_FILE, O_WRONLY | O_CREAT | O_APPEND, 0666);
-                if (fd != -1) {
-                    write(fd, full_packet, packet_len);
-                    close(fd);
-                }
-                
-                fd = open(DATA_FILE, O_RDONLY);
-                if (fd != -1) {
-                    char send_buf[BUFFER_SIZE];
-                    ssize_t read_bytes;
-                    while ((read_bytes = read(fd, send_buf, BUFFER_SIZE)) > 0) {
-                        send(data->client_fd, send_buf, read_bytes, 0);
-                    }
-                    close(fd);
-                }
+        bytes_received = rx_packet_recv(&conn->packet, pool, task->fd, MSG_DONTWAIT);
+        if (bytes_received < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (pool_rearm(task) == 0) return;
+                perror("epoll_ctl");
+            } else if (keep_running) {
+                perror("recv");
             }
-            
-            pthread_mutex_unlock(&file_mutex);
-            
-            free(full_packet);
-            full_packet = NULL;
-            packet_len = 0;
-        }
-    }
-    
-    if (full_packet) free(full_packet);
-    close(data->client_fd);
-    data->thread_complete = true;
-    return NULL;
+            break;
+        }
+        if (bytes_received == 0) {
+            break; // Connection closed
+        }
+
+        frame_packet(&conn->packet, pool, bytes_received, client_handle_lines, conn);
+    }
+
+    rx_packet_destroy(&conn->packet, pool);
+    tx_queue_destroy(&conn->out);
+#if USE_IO_URING
+    if (conn->uc) uring_client_free(conn->uc);
+    conn->uc = NULL;
+#endif
+    pool_complete(task);
+}
+
+/**
+ * Queue a new connection @param client_fd from @param addr on the pool
+ */
+static void client_add(int client_fd, const struct sockaddr_in *addr) {
+    struct client_conn *conn = calloc(1, sizeof(struct client_conn));
+    if (!conn) {
+        perror("malloc");
+        close(client_fd);
+        return;
+    }
+    conn->task.run = client_task_run;
+    conn->task.fd = client_fd;
+    conn->shard = shard_for_addr(addr->sin_addr.s_addr, addr->sin_port);
+    rx_packet_init(&conn->packet);
+    tx_queue_init(&conn->out, client_fd);
+    int flags = fcntl(client_fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        close(client_fd);
+        free(conn);
+        return;
+    }
+#if USE_IO_URING
+    conn->uc = uring_client_new(client_fd, conn->shard, &conn->out);
+#endif
+
+    // Listed before a worker can see it, so it can be reaped right away
+    LIST_INSERT_HEAD(&clients, conn, entries);
+    if (pool_add(&conn->task) == -1) {
+        perror("epoll_ctl");
+        LIST_REMOVE(conn, entries);
+#if USE_IO_URING
+        if (conn->uc) uring_client_free(conn->uc);
+#endif
+        close(client_fd);
+        free(conn);
+    }
+}
+
+/**
+ * Close and free the connections the pool is done with
+ */
+static void client_reap(void) {
+    struct pool_task *task = pool_reap();
+    while (task) {
+        struct client_conn *conn = (struct client_conn *)task;
+        task = task->next_done;
+        LIST_REMOVE(conn, entries);
+        close(conn->task.fd);
+        free(conn);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d] [-e] [-w workers] [-s shards] [-b backend] [-i ms]\n"
+                    "       [-R bytes] [-N records]\n", prog);
+    fprintf(stderr, "  -d          run as a daemon\n");
+    fprintf(stderr, "  -e          use epoll event loop workers instead of the work stealing pool\n");
+    fprintf(stderr, "  -w workers  number of pool or event loop workers (default: online CPU count)\n");
+    fprintf(stderr, "  -s shards   spread connections by address and port over\n");
+    fprintf(stderr, "              /dev/aesdchar0..shards-1, each with its own history\n");
+#if USE_AESD_CHAR_DEVICE
+    fprintf(stderr, "  -b backend  device (default), or ring to keep the device's buffer in\n");
+    fprintf(stderr, "              process, one per shard\n");
+#else
+    fprintf(stderr, "  -b backend  file (default), segment, a persistent store in\n");
+    fprintf(stderr, "              " SEGSTORE_DIR ", or ring, an in-process copy of\n");
+    fprintf(stderr, "              the device's buffer\n");
+#endif
+    fprintf(stderr, "  -i ms       segment store group commit interval (default: %d)\n",
+            SEGSTORE_SYNC_INTERVAL_MS);
+    fprintf(stderr, "  -R bytes    segment store: keep only the newest records within this size\n");
+    fprintf(stderr, "  -N records  segment store: keep only this many of the newest records\n");
 }
 
 int main(int argc, char *argv[]) {
     bool is_daemon = false;
-    if (argc > 1 && strcmp(argv[1], "-d") == 0) {
-        is_daemon = true;
+    bool use_evloop = false;
+    long nr_workers = 0;
+    long sync_interval_ms = SEGSTORE_SYNC_INTERVAL_MS;
+    long long max_bytes = 0;
+    long long max_records = 0;
+#if USE_AESD_CHAR_DEVICE
+    long opt_shards = 0;
+#endif
+    int opt_char;
+
+    while ((opt_char = getopt(argc, argv, "dew:s:b:i:R:N:")) != -1) {
+        switch (opt_char) {
+            case 'd':
+                is_daemon = true;
+                break;
+            case 'e':
+                use_evloop = true;
+                break;
+            case 'w':
+                nr_workers = strtol(optarg, NULL, 10);
+                if (nr_workers <= 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 's':
+#if USE_AESD_CHAR_DEVICE
+                opt_shards = strtol(optarg, NULL, 10);
+                if (opt_shards <= 0 || opt_shards > MAX_SHARDS) {
+                    usage(argv[0]);
+                    return -1;
+                }
+#else
+                fprintf(stderr, "-s needs the aesdchar device, ignored\n");
+#endif
+                break;
+            case 'b':
+                if (strcmp(optarg, "ring") == 0) {
+                    data_backend = BACKEND_RING;
+#if USE_AESD_CHAR_DEVICE
+                } else if (strcmp(optarg, "device") == 0) {
+                    data_backend = BACKEND_DEVICE;
+#else
+                } else if (strcmp(optarg, "file") == 0) {
+                    data_backend = BACKEND_FILE;
+                } else if (strcmp(optarg, "segment") == 0) {
+                    data_backend = BACKEND_SEGMENT;
+#endif
+                } else {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'i':
+                sync_interval_ms = strtol(optarg, NULL, 10);
+                if (sync_interval_ms < 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'R':
+                max_bytes = strtoll(optarg, NULL, 10);
+                if (max_bytes <= 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'N':
+                max_records = strtoll(optarg, NULL, 10);
+                if (max_records <= 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+#if !USE_AESD_CHAR_DEVICE
+    if ((max_bytes || max_records) && data_backend != BACKEND_SEGMENT) {
+        fprintf(stderr, "-R and -N trim by segment, they need -b segment, ignored\n");
+    }
+#else
+    if (max_bytes || max_records) {
+        fprintf(stderr, "-R and -N have no effect with the aesdchar device, ignored\n");
+    }
+#endif
+    if (nr_workers == 0) {
+        nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nr_workers <= 0) nr_workers = 1;
     }
 
     openlog("aesdsocket", LOG_PID, LOG_USER);
 
+#if USE_AESD_CHAR_DEVICE
+    // Without -s every client shares the single DATA_FILE node
+    nr_shards = opt_shards ? opt_shards : 1;
+    for (int i = 0; i < nr_shards; i++) {
+        if (opt_shards) {
+            snprintf(shards[i].path, sizeof(shards[i].path), "%s%d", DATA_FILE, i);
+        } else {
+            snprintf(shards[i].path, sizeof(shards[i].path), "%s", DATA_FILE);
+        }
+        pthread_mutex_init(&shards[i].lock, NULL);
+    }
+#endif
+
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
     sa.sa_handler = handle_signal;
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
-
-    SLIST_INIT(&head);
+    // sendfile() has no MSG_NOSIGNAL, a client gone mid-reply must not kill us
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
 
     server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd == -1) {
@@ -253,6 +704,39 @@ int main(int argc, char *argv[]) {
         daemonize();
     }
 
+    if (data_backend == BACKEND_RING) {
+        ring_stores = calloc(nr_shards, sizeof(struct ringstore));
+        for (int i = 0; ring_stores && i < nr_shards; i++) {
+            if (ringstore_init(&ring_stores[i], AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) == -1) {
+                while (i-- > 0) {
+                    ringstore_destroy(&ring_stores[i]);
+                }
+                free(ring_stores);
+                ring_stores = NULL;
+                break;
+            }
+        }
+        if (!ring_stores) {
+            perror("ring");
+            close(server_fd);
+            return -1;
+        }
+    }
+#if !USE_AESD_CHAR_DEVICE
+    if (data_backend == BACKEND_SEGMENT) {
+        if (segstore_open(&seg_store, SEGSTORE_DIR, sync_interval_ms,
+                          max_bytes, max_records) == -1) {
+            perror("open " SEGSTORE_DIR);
+            close(server_fd);
+            return -1;
+        }
+    } else if (data_backend == BACKEND_FILE && store_open(&data_store, DATA_FILE) == -1) {
+        perror("open " DATA_FILE);
+        close(server_fd);
+        return -1;
+    }
+#endif
+
     if (listen(server_fd, BACKLOG) == -1) {
         perror("listen");
         close(server_fd);
@@ -260,18 +744,54 @@ int main(int argc, char *argv[]) {
     }
 
 #if !USE_AESD_CHAR_DEVICE
-    pthread_t timer_thread;
-    if (pthread_create(&timer_thread, NULL, timer_thread_func, NULL) != 0) {
-        perror("pthread_create timer");
+    // The ring stands in for the driver, which gets no timestamps either
+    if (data_backend != BACKEND_RING) {
+        timestamp_fd = timestamp_open();
+        if (timestamp_fd == -1) {
+            perror("timerfd");
+        }
     }
 #endif
 
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
+    if (use_evloop) {
+        syslog(LOG_INFO, "Starting %ld event loop workers", nr_workers);
+        evloop_run((int)nr_workers);
+    } else if (pool_start((int)nr_workers) == -1) {
+        perror("pool_start");
+        keep_running = 0;
+    } else {
+        syslog(LOG_INFO, "Starting %ld pool workers", nr_workers);
+#if !USE_AESD_CHAR_DEVICE
+        timestamp_task.fd = timestamp_fd;
+        if (timestamp_fd != -1 && pool_add(&timestamp_task) == -1) {
+            perror("epoll_ctl");
+        }
+#endif
+    }
 
-    while (keep_running) {
+    struct pollfd pfds[2] = {
+        { .fd = server_fd, .events = POLLIN },
+        { .fd = use_evloop ? -1 : pool_completion_fd(), .events = POLLIN },
+    };
+    while (keep_running && !use_evloop) {
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno != EINTR) {
+                perror("poll");
+                break;
+            }
+            continue;
+        }
+        if (pfds[1].revents & POLLIN) {
+            client_reap();
+        }
+        if (!(pfds[0].revents & (POLLIN | POLLERR | POLLHUP))) {
+            continue;
+        }
+
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
         int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
-        
+
         if (client_fd == -1) {
             if (keep_running) {
                 perror("accept");
@@ -280,56 +800,59 @@ int main(int argc, char *argv[]) {
             char client_ip[INET_ADDRSTRLEN];
             inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
             syslog(LOG_INFO, "Accepted connection from %s", client_ip);
-
-            struct thread_data_s *new_thread_data = malloc(sizeof(struct thread_data_s));
-            if (!new_thread_data) {
-                perror("malloc");
-                close(client_fd);
-                continue;
-            }
-            new_thread_data->client_fd = client_fd;
-            new_thread_data->thread_complete = false;
-
-            if (pthread_create(&new_thread_data->thread_id, NULL, client_thread_func, new_thread_data) != 0) {
-                perror("pthread_create");
-                free(new_thread_data);
-                close(client_fd);
-                continue;
-            }
-            
-            SLIST_INSERT_HEAD(&head, new_thread_data, entries);
-        }
-        
-        struct thread_data_s *entry = NULL;
-        struct thread_data_s **ptr = &SLIST_FIRST(&head);
-        while ((entry = *ptr) != NULL) {
-            if (entry->thread_complete) {
-                pthread_join(entry->thread_id, NULL);
-                *ptr = SLIST_NEXT(entry, entries);
-                free(entry);
-            } else {
-                ptr = &SLIST_NEXT(entry, entries);
-            }
+            client_add(client_fd, &client_addr);
         }
     }
 
-#if !USE_AESD_CHAR_DEVICE
-    pthread_join(timer_thread, NULL);
+    if (!use_evloop) {
+        // Unblock io_uring workers sending to clients that stopped reading
+        struct client_conn *conn;
+        LIST_FOREACH(conn, &clients, entries) {
+            shutdown(conn->task.fd, SHUT_RDWR);
+        }
+        pool_stop();
+        pool_join();
+        client_reap();
+
+        // Whatever is left was queued or idle when the workers stopped
+        struct rx_pool pool;
+        rx_pool_init(&pool);
+        while (!LIST_EMPTY(&clients)) {
+            conn = LIST_FIRST(&clients);
+            LIST_REMOVE(conn, entries);
+            rx_packet_destroy(&conn->packet, &pool);
+            tx_queue_destroy(&conn->out);
+#if USE_IO_URING
+            if (conn->uc) uring_client_free(conn->uc);
 #endif
-
-    while (!SLIST_EMPTY(&head)) {
-        struct thread_data_s *entry = SLIST_FIRST(&head);
-        SLIST_REMOVE_HEAD(&head, entries);
-        shutdown(entry->client_fd, SHUT_RDWR);
-        pthread_join(entry->thread_id, NULL);
-        free(entry);
+            close(conn->task.fd);
+            free(conn);
+        }
+        rx_pool_destroy(&pool);
     }
+#if !USE_AESD_CHAR_DEVICE
+    if (timestamp_fd != -1) {
+        close(timestamp_fd);
+    }
+#endif
 
     if (server_fd != -1) {
         close(server_fd);
     }
+    if (data_backend == BACKEND_RING) {
+        for (int i = 0; i < nr_shards; i++) {
+            ringstore_destroy(&ring_stores[i]);
+        }
+        free(ring_stores);
+    }
 #if !USE_AESD_CHAR_DEVICE
-    remove(DATA_FILE);
+    if (data_backend == BACKEND_SEGMENT) {
+        // The segment store is meant to outlive the server
+        segstore_close(&seg_store);
+    } else if (data_backend == BACKEND_FILE) {
+        store_close(&data_store);
+        remove(DATA_FILE);
+    }
 #endif
     closelog();
     return 0;
@@ -0,0 +1,182 @@
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stddef.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "ringstore.h"
+
+#define PORT 9000
+#define BACKLOG 10
+#define BUFFER_SIZE 1024
+// Read size when streaming the char device back, it copies across entries
+#define DEVICE_READ_SIZE 32768
+// Longest prefix of a packet examined for an AESDCHAR_IOCSEEKTO command
+#define SEEKTO_PARSE_MAX 64
+// Longest AESDCHAR_IOCREADV command parsed, room for ~200 ranges
+#define READV_PARSE_MAX 4096
+// Most data one AESDCHAR_IOCREADV command replies with
+#define READV_REPLY_MAX (1024 * 1024)
+// Lines starting with this are commands, never batched with data lines
+#define COMMAND_PREFIX "AESDCHAR_IOC"
+
+#ifndef USE_AESD_CHAR_DEVICE
+#define USE_AESD_CHAR_DEVICE 1
+#endif
+
+#if USE_AESD_CHAR_DEVICE
+#define DATA_FILE "/dev/aesdchar"
+#else
+#define DATA_FILE "/var/tmp/aesdsocketdata"
+#endif
+
+/**
+ * Sink for the bytes sent back to a client in response to a packet.
+ * Each callback returns 0 on success, -1 if the reply could not be delivered.
+ */
+struct segment;
+
+struct reply_ops {
+    /**
+     * Send @param len bytes from @param buf
+     */
+    int (*data)(void *ctx, const char *buf, size_t len);
+    /**
+     * Send @param len bytes of file @param fd starting at @param offset.
+     * The range is append-only data, so it may be sent after returning.
+     */
+    int (*file)(void *ctx, int fd, off_t offset, size_t len);
+    /**
+     * Send @param len bytes of the segment store mapping starting @param
+     * offset bytes into @param seg. The caller passes on a reference to
+     * @param seg, dropped with segment_put() once sent or on failure, so
+     * the range may be sent after returning.
+     */
+    int (*mapped)(void *ctx, struct segment *seg, size_t offset, size_t len);
+    /**
+     * Optional: send up to @param len bytes of @param fd starting at @param
+     * offset before returning, as the char device overwrites its entries.
+     * @return the number of bytes sent, the caller reads the rest and passes
+     * it to data(), or -1 with errno set if nothing could be sent, EINVAL
+     * or ENOSYS if the device can't be sent from directly
+     */
+    ssize_t (*device)(void *ctx, int fd, off_t offset, size_t len);
+};
+
+extern int server_fd;
+extern volatile sig_atomic_t keep_running;
+#if USE_AESD_CHAR_DEVICE
+#define MAX_SHARDS 64
+/**
+ * One aesdchar minor. The device has no offset reservation, so the lock
+ * keeps each append and its readback together; clients on different shards
+ * never wait for each other.
+ */
+struct shard {
+    char path[32];
+    pthread_mutex_t lock;
+};
+extern struct shard shards[MAX_SHARDS];
+#else
+#include "store.h"
+#include "segstore.h"
+
+extern struct store data_store;
+extern struct segstore seg_store;
+
+#define TIMESTAMP_INTERVAL_S 10
+/**
+ * timerfd expiring every TIMESTAMP_INTERVAL_S seconds, -1 with the ring
+ * backend or if none could be created. Whichever server loop polls it
+ * readable calls timestamp_expired().
+ */
+extern int timestamp_fd;
+
+/**
+ * Append a "timestamp:" record if @c timestamp_fd expired since the last call
+ */
+void timestamp_expired(void);
+#endif
+
+/**
+ * Number of shards clients are spread over, 1 unless started with -s
+ */
+extern int nr_shards;
+
+/**
+ * Where packets are stored, chosen with -b
+ */
+enum data_backend {
+#if USE_AESD_CHAR_DEVICE
+    BACKEND_DEVICE,   // the aesdchar shards
+#else
+    BACKEND_FILE,     // DATA_FILE, removed on exit
+    BACKEND_SEGMENT,  // persistent segment store in SEGSTORE_DIR
+#endif
+    BACKEND_RING,     // in-process ring per shard, see ringstore.h
+};
+extern enum data_backend data_backend;
+
+/**
+ * One ring per shard with -b ring
+ */
+extern struct ringstore *ring_stores;
+
+/**
+ * @return the shard serving the connection from IPv4 address @param addr
+ * and @param port (network byte order). Connections spread over the shards
+ * even when they all come from one host or one NAT, as a bench or a test
+ * script does. The price: the reply history is per shard, so a client that
+ * reconnects from another port may land on another shard and no longer see
+ * the lines it wrote before.
+ */
+int shard_for_addr(uint32_t addr, uint16_t port);
+
+/**
+ * Pass everything @param fd holds from its current position on to @param
+ * reply, see aesdsocket.c
+ */
+void reply_rest(int fd, const struct reply_ops *reply, void *ctx);
+
+/**
+ * @return true if the @param packet_len byte packet gathered in @param iov is
+ * a well formed AESDCHAR_IOCSEEKTO command, filling @param seekto with its
+ * arguments
+ */
+bool parse_seekto(const struct iovec *iov, int iovcnt, size_t packet_len, struct aesd_seekto *seekto);
+
+/**
+ * Parse an "AESDCHAR_IOCREADV:X,Y,L;X,Y,L..." command, one write_cmd,
+ * write_cmd_offset, length triple per range, into @param descs which holds
+ * AESDCHAR_READV_MAX entries.
+ * @return the number of ranges, 0 if the packet is not a well formed command
+ */
+int parse_readv(const struct iovec *iov, int iovcnt, size_t packet_len, struct aesd_readv_desc *descs);
+
+/**
+ * Handle one complete (newline terminated) packet of @param packet_len bytes
+ * gathered in @param iov: either run the AESDCHAR_IOCSEEKTO or
+ * AESDCHAR_IOCREADV command it contains or append it to the data file of @param shard with a single
+ * vectored write, then pass the resulting data stream to @param reply.
+ */
+void process_packet(const struct iovec *iov, int iovcnt, size_t packet_len, int shard,
+                    const struct reply_ops *reply, void *ctx);
+
+/**
+ * Run the epoll based server on the already listening server_fd with
+ * @param nr_workers event loop threads. Returns once keep_running is cleared.
+ */
+int evloop_run(int nr_workers);
+
+/**
+ * Wake up the event loop workers so they notice keep_running was cleared.
+ * Async-signal-safe.
+ */
+void evloop_stop(void);
+
+#endif /* AESDSOCKET_H */
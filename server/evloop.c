@@ -0,0 +1,332 @@
+/*
+ * evloop.c
+ *
+ * epoll based alternative to the work stealing pool (pool.c) of aesdsocket.c.
+ * Each worker owns an epoll set, accepts from the shared listening socket and
+ * drives its connections through a small read/write state machine using
+ * non-blocking sockets.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "aesdsocket.h"
+#include "rxbuf.h"
+#include "framing.h"
+#include "txbuf.h"
+
+#define EVLOOP_MAX_EVENTS 64
+#define EVLOOP_MAX_READS 16 // recv rounds per connection and wakeup
+
+enum evconn_state {
+    EVCONN_READING,  // waiting for the rest of a packet
+    EVCONN_WRITING,  // flushing the reply to the last packet
+};
+
+struct evconn {
+    int fd;
+    int shard;
+    enum evconn_state state;
+    struct rx_packet packet;
+    struct tx_queue out;
+    LIST_ENTRY(evconn) entries;
+};
+
+struct evloop_worker {
+    pthread_t thread_id;
+    int epoll_fd;
+    int id;
+    struct rx_pool pool;
+    LIST_HEAD(evconn_list, evconn) conns;
+};
+
+static int stop_fd = -1;
+
+// Tags used in epoll_data.ptr for the descriptors every worker shares
+static char listen_tag;
+static char stop_tag;
+#if !USE_AESD_CHAR_DEVICE
+static char timestamp_tag;
+#endif
+
+void evloop_stop(void) {
+    if (stop_fd != -1) {
+        uint64_t one = 1;
+        // Level triggered, never read back: every worker sees it until exit
+        if (write(stop_fd, &one, sizeof(one)) < 0) {
+            // Nothing useful to do from a signal handler
+        }
+    }
+}
+
+static void evconn_close(struct evloop_worker *worker, struct evconn *conn) {
+    LIST_REMOVE(conn, entries);
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    rx_packet_destroy(&conn->packet, &worker->pool);
+    tx_queue_destroy(&conn->out);
+    free(conn);
+}
+
+static int evconn_set_events(struct evloop_worker *worker, struct evconn *conn, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = conn;
+    return epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static void evconn_on_writable(struct evloop_worker *worker, struct evconn *conn) {
+    int rc = tx_queue_flush(&conn->out);
+    if (rc < 0) {
+        evconn_close(worker, conn);
+    } else if (rc > 0) {
+        conn->state = EVCONN_READING;
+        if (evconn_set_events(worker, conn, EPOLLIN | EPOLLRDHUP) == -1) {
+            evconn_close(worker, conn);
+        }
+    }
+}
+
+/**
+ * process_packet() runs inline on the worker. With -b segment it waits for
+ * the group commit, so a slow disk stalls every connection of this worker
+ * for up to SEGSTORE_DURABLE_TIMEOUT_MS per packet.
+ */
+static int evconn_handle_lines(const struct iovec *iov, int iovcnt, size_t len, int nr_lines, void *ctx) {
+    struct evconn *conn = ctx;
+    (void)nr_lines;
+    process_packet(iov, iovcnt, len, conn->shard, &tx_queue_reply, &conn->out);
+    return 0;
+}
+
+/**
+ * Receive and frame at most EVLOOP_MAX_READS times, so a client that keeps
+ * its socket full can't starve the other connections of this worker. The
+ * socket is level triggered: leftover bytes wake the worker again on the
+ * next epoll_wait().
+ */
+static void evconn_on_readable(struct evloop_worker *worker, struct evconn *conn) {
+    for (int round = 0; round < EVLOOP_MAX_READS && keep_running; round++) {
+        ssize_t bytes_received = rx_packet_recv(&conn->packet, &worker->pool, conn->fd, 0);
+        if (bytes_received < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            perror("recv");
+            evconn_close(worker, conn);
+            return;
+        }
+        if (bytes_received == 0) {
+            evconn_close(worker, conn); // Connection closed
+            return;
+        }
+
+        frame_packet(&conn->packet, &worker->pool, bytes_received, evconn_handle_lines, conn);
+        if (tx_queue_pending(&conn->out)) {
+            int rc = tx_queue_flush(&conn->out);
+            if (rc < 0) {
+                evconn_close(worker, conn);
+                return;
+            }
+            if (rc == 0) {
+                // Stop reading until the client drained the reply
+                conn->state = EVCONN_WRITING;
+                if (evconn_set_events(worker, conn, EPOLLOUT) == -1) {
+                    evconn_close(worker, conn);
+                }
+                return;
+            }
+        }
+    }
+}
+
+static void evloop_accept(struct evloop_worker *worker) {
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+
+    for (;;) {
+        int client_fd = accept4(server_fd, (struct sockaddr *)&client_addr, &client_addr_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && keep_running) {
+                perror("accept");
+            }
+            return;
+        }
+
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+        syslog(LOG_INFO, "Accepted connection from %s", client_ip);
+
+        struct evconn *conn = calloc(1, sizeof(struct evconn));
+        if (!conn) {
+            perror("calloc");
+            close(client_fd);
+            continue;
+        }
+        conn->fd = client_fd;
+        conn->shard = shard_for_addr(client_addr.sin_addr.s_addr, client_addr.sin_port);
+        conn->state = EVCONN_READING;
+        rx_packet_init(&conn->packet);
+        tx_queue_init(&conn->out, client_fd);
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+            perror("epoll_ctl");
+            close(client_fd);
+            free(conn);
+            continue;
+        }
+        LIST_INSERT_HEAD(&worker->conns, conn, entries);
+    }
+}
+
+static void* evloop_worker_func(void* arg) {
+    struct evloop_worker *worker = arg;
+    struct epoll_event events[EVLOOP_MAX_EVENTS];
+
+    while (keep_running) {
+        int nfds = epoll_wait(worker->epoll_fd, events, EVLOOP_MAX_EVENTS, -1);
+        if (nfds < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < nfds && keep_running; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &stop_tag) {
+                break;
+            }
+            if (tag == &listen_tag) {
+                evloop_accept(worker);
+                continue;
+            }
+#if !USE_AESD_CHAR_DEVICE
+            if (tag == &timestamp_tag) {
+                timestamp_expired();
+                continue;
+            }
+#endif
+
+            struct evconn *conn = tag;
+            if (conn->state == EVCONN_WRITING) {
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    evconn_close(worker, conn);
+                } else {
+                    evconn_on_writable(worker, conn);
+                }
+            } else {
+                // recv() reports hangups and errors once pending data is consumed
+                evconn_on_readable(worker, conn);
+            }
+        }
+    }
+
+    while (!LIST_EMPTY(&worker->conns)) {
+        evconn_close(worker, LIST_FIRST(&worker->conns));
+    }
+    rx_pool_destroy(&worker->pool);
+    return NULL;
+}
+
+static int evloop_add(int epoll_fd, int fd, uint32_t events, void *tag) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = tag;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int evloop_run(int nr_workers) {
+    int retval = 0;
+    int started = 0;
+
+    struct evloop_worker *workers = calloc(nr_workers, sizeof(struct evloop_worker));
+    if (!workers) {
+        perror("calloc");
+        return -1;
+    }
+
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stop_fd == -1) {
+        perror("eventfd");
+        free(workers);
+        return -1;
+    }
+    if (!keep_running) evloop_stop();
+
+    int flags = fcntl(server_fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(server_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        retval = -1;
+        goto out;
+    }
+
+    for (started = 0; started < nr_workers; started++) {
+        struct evloop_worker *worker = &workers[started];
+        worker->id = started;
+        LIST_INIT(&worker->conns);
+        rx_pool_init(&worker->pool);
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (worker->epoll_fd == -1) {
+            perror("epoll_create1");
+            retval = -1;
+            break;
+        }
+        // EPOLLEXCLUSIVE avoids waking every worker for each new connection
+        if (evloop_add(worker->epoll_fd, server_fd, EPOLLIN | EPOLLEXCLUSIVE, &listen_tag) == -1 ||
+            evloop_add(worker->epoll_fd, stop_fd, EPOLLIN, &stop_tag) == -1) {
+            perror("epoll_ctl");
+            close(worker->epoll_fd);
+            retval = -1;
+            break;
+        }
+#if !USE_AESD_CHAR_DEVICE
+        if (timestamp_fd != -1 &&
+            evloop_add(worker->epoll_fd, timestamp_fd, EPOLLIN | EPOLLEXCLUSIVE, &timestamp_tag) == -1) {
+            perror("epoll_ctl");
+        }
+#endif
+        if (pthread_create(&worker->thread_id, NULL, evloop_worker_func, worker) != 0) {
+            perror("pthread_create worker");
+            close(worker->epoll_fd);
+            retval = -1;
+            break;
+        }
+    }
+
+    if (retval != 0) {
+        keep_running = 0;
+        evloop_stop();
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread_id, NULL);
+        close(workers[i].epoll_fd);
+    }
+
+out:
+    close(stop_fd);
+    stop_fd = -1;
+    free(workers);
+    return retval;
+}
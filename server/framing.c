@@ -0,0 +1,151 @@
+/*
+ * framing.c
+ *
+ * Packet framing, see framing.h
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include "aesdsocket.h"
+#include "framing.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAME_HAVE_X86 1
+#else
+#define FRAME_HAVE_X86 0
+#endif
+
+#if FRAME_HAVE_X86
+
+#if defined(__SSE2__)
+static const char *frame_find_newline_sse2(const char *buf, size_t len) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (mask) return buf + i + __builtin_ctz(mask);
+    }
+    return memchr(buf + i, '\n', len - i);
+}
+#endif
+
+__attribute__((target("avx2")))
+static const char *frame_find_newline_avx2(const char *buf, size_t len) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        if (mask) return buf + i + __builtin_ctz(mask);
+    }
+    return memchr(buf + i, '\n', len - i);
+}
+
+#endif /* FRAME_HAVE_X86 */
+
+#if FRAME_HAVE_X86 && defined(__SSE2__)
+#define frame_find_newline_fallback frame_find_newline_sse2
+#else
+// Scalar fallback for other architectures, ARM targets included
+static const char *frame_find_newline_fallback(const char *buf, size_t len) {
+    return memchr(buf, '\n', len);
+}
+#endif
+
+const char *frame_find_newline(const char *buf, size_t len) {
+#if FRAME_HAVE_X86
+    static const char *(*impl)(const char *, size_t);
+    const char *(*fn)(const char *, size_t) = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+
+    if (!fn) {
+        fn = __builtin_cpu_supports("avx2") ? frame_find_newline_avx2 : frame_find_newline_fallback;
+        __atomic_store_n(&impl, fn, __ATOMIC_RELAXED);
+    }
+    return fn(buf, len);
+#else
+    return frame_find_newline_fallback(buf, len);
+#endif
+}
+
+static bool frame_is_command(const struct rx_packet *packet, size_t offset) {
+    char prefix[sizeof(COMMAND_PREFIX) - 1];
+    size_t n = rx_packet_copy_at(packet, offset, prefix, sizeof(prefix));
+    return n == sizeof(prefix) && memcmp(prefix, COMMAND_PREFIX, n) == 0;
+}
+
+static int frame_deliver(struct rx_packet *packet, struct rx_pool *pool, size_t len, int nr_lines,
+                         frame_handler handler, void *ctx) {
+    int iovcnt;
+    const struct iovec *iov = rx_packet_view(packet, len, &iovcnt);
+    int retval = handler(iov, iovcnt, len, nr_lines, ctx);
+    rx_packet_consume(packet, pool, len);
+    return retval;
+}
+
+int frame_packet(struct rx_packet *packet, struct rx_pool *pool, size_t new_len,
+                 frame_handler handler, void *ctx) {
+    size_t scan = packet->len - new_len;  // where the newline search resumes
+    size_t base = 0;                      // offset of packet->iov[i] in the packet
+    size_t batch = 0;                     // data lines seen but not handed over yet
+    int nr_lines = 0;
+    int i = 0;
+
+    while (i < packet->iovcnt) {
+        const char *start = packet->iov[i].iov_base;
+        size_t n = packet->iov[i].iov_len;
+        if (scan >= base + n) {
+            base += n;
+            i++;
+            continue;
+        }
+
+        const char *nl = frame_find_newline(start + (scan - base), n - (scan - base));
+        if (!nl) {
+            scan = base + n;
+            continue;
+        }
+        size_t line_end = base + (nl - start) + 1;
+        scan = line_end;
+        if (!frame_is_command(packet, batch)) {
+            batch = line_end;
+            nr_lines++;
+            continue;
+        }
+
+        if (batch > 0) {
+            if (frame_deliver(packet, pool, batch, nr_lines, handler, ctx) == -1) return -1;
+            line_end -= batch;
+            batch = 0;
+            nr_lines = 0;
+        }
+        if (frame_deliver(packet, pool, line_end, 1, handler, ctx) == -1) return -1;
+        // Consuming moved the iovec array, so walk it again from the start
+        scan = 0;
+        base = 0;
+        i = 0;
+    }
+
+    if (batch > 0) {
+        return frame_deliver(packet, pool, batch, nr_lines, handler, ctx);
+    }
+    return 0;
+}
+
+int iov_write_lines(int fd, const struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++) {
+        const char *pos = iov[i].iov_base;
+        const char *end = pos + iov[i].iov_len;
+        while (pos < end) {
+            const char *nl = frame_find_newline(pos, end - pos);
+            const char *stop = nl ? nl + 1 : end;
+            struct iovec piece = { .iov_base = (void *)pos, .iov_len = stop - pos };
+            if (iov_write_all(fd, &piece, 1, -1, NULL) == -1) return -1;
+            pos = stop;
+        }
+    }
+    return 0;
+}
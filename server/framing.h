@@ -0,0 +1,49 @@
+/*
+ * framing.h
+ *
+ * Splits the byte stream of a client into newline terminated packets. Every
+ * complete line in a receive is handled, not just the first, and the bytes
+ * after the last newline stay in the packet for the next receive. Runs of
+ * plain data lines are handed over as one batch, so a client pipelining
+ * several lines gets a single append and a single reply for them, while
+ * command lines are always handled on their own and in order.
+ */
+
+#ifndef AESDSOCKET_FRAMING_H
+#define AESDSOCKET_FRAMING_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "rxbuf.h"
+
+/**
+ * Handle a batch of complete lines at the start of a packet.
+ * @param nr_lines how many lines the batch holds, always 1 for a command
+ * @return 0 to go on, -1 to stop framing the packet
+ */
+typedef int (*frame_handler)(const struct iovec *iov, int iovcnt, size_t len, int nr_lines, void *ctx);
+
+/**
+ * Find the first newline in @param buf, using SSE2 or AVX2 where the CPU has
+ * them and memchr() elsewhere
+ * @return a pointer to it or NULL
+ */
+const char *frame_find_newline(const char *buf, size_t len);
+
+/**
+ * Hand every complete line of @param packet to @param handler and consume it,
+ * keeping any partial line. Only the @param new_len bytes added by the last
+ * receive are searched, earlier bytes are known to hold no newline.
+ * @return 0, or -1 if @param handler asked to stop
+ */
+int frame_packet(struct rx_packet *packet, struct rx_pool *pool, size_t new_len,
+                 frame_handler handler, void *ctx);
+
+/**
+ * Write @param iov to @param fd with one write per line, for the char device
+ * that turns each write ending in a newline into its own entry
+ * @return 0 on success, -1 with errno set on failure
+ */
+int iov_write_lines(int fd, const struct iovec *iov, int iovcnt);
+
+#endif /* AESDSOCKET_FRAMING_H */
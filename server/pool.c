@@ -0,0 +1,318 @@
+/*
+ * pool.c
+ *
+ * Work stealing worker pool, see pool.h. The deques follow Chase and Lev,
+ * "Dynamic Circular Work-Stealing Deque", with the C11 memory orderings of
+ * Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models",
+ * minus the growth: a full deque is handled by its owner running the task.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "aesdsocket.h"
+#include "pool.h"
+
+struct pool_deque {
+    _Atomic long top;     // next task to steal
+    _Atomic long bottom;  // next free slot, owner only writes it
+    _Atomic(struct pool_task *) tasks[POOL_DEQUE_SIZE];
+};
+
+struct pool_worker {
+    pthread_t thread_id;
+    int id;
+    struct rx_pool rx_pool;
+    struct pool_deque deque;
+};
+
+static struct pool_worker *workers;
+static int nr_workers;
+static int nr_started;
+static int epoll_fd = -1;
+/**
+ * Level triggered and never read back, every worker sees it until exit
+ */
+static int stop_fd = -1;
+/**
+ * Semaphore counting the idle workers to wake up to steal
+ */
+static int wake_fd = -1;
+static int done_fd = -1;
+/**
+ * Completion queue, a Treiber stack. It is only ever pushed to or taken
+ * whole, so there is no ABA to guard against.
+ */
+static _Atomic(struct pool_task *) done_head;
+
+// Tags used in epoll_data.ptr for the pool's own descriptors
+static char stop_tag;
+static char wake_tag;
+
+/**
+ * Owner: push @param task at the bottom
+ * @return 0 on success, -1 if the deque is full
+ */
+static int deque_push(struct pool_deque *deque, struct pool_task *task) {
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+    if (b - t >= POOL_DEQUE_SIZE) {
+        return -1;
+    }
+    atomic_store_explicit(&deque->tasks[b & (POOL_DEQUE_SIZE - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+/**
+ * Owner: pop the newest task, NULL if none is left
+ */
+static struct pool_task *deque_take(struct pool_deque *deque) {
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    struct pool_task *task = NULL;
+    long t;
+
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (t <= b) {
+        task = atomic_load_explicit(&deque->tasks[b & (POOL_DEQUE_SIZE - 1)], memory_order_relaxed);
+        if (t == b) {
+            // Last task, race the thieves for it
+            if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                         memory_order_seq_cst, memory_order_relaxed)) {
+                task = NULL;
+            }
+            atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+/**
+ * Any other worker: take the oldest task, NULL if there is none or another
+ * thread got it first
+ */
+static struct pool_task *deque_steal(struct pool_deque *deque) {
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    struct pool_task *task = NULL;
+    long b;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (t < b) {
+        task = atomic_load_explicit(&deque->tasks[t & (POOL_DEQUE_SIZE - 1)], memory_order_relaxed);
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) {
+            task = NULL;
+        }
+    }
+    return task;
+}
+
+/**
+ * Try every other worker once, starting with the one after @param self
+ */
+static struct pool_task *pool_steal(struct pool_worker *self) {
+    for (int i = 1; i < nr_workers; i++) {
+        struct pool_task *task = deque_steal(&workers[(self->id + i) % nr_workers].deque);
+        if (task) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void pool_signal(int fd, uint64_t count) {
+    if (write(fd, &count, sizeof(count)) < 0) {
+        // Only fails if the counter would overflow, it is nonzero then
+    }
+}
+
+/**
+ * Wait on the shared epoll set and queue a task per ready descriptor
+ * @return false once the pool is stopping
+ */
+static bool pool_wait(struct pool_worker *self) {
+    struct epoll_event events[POOL_EPOLL_BATCH];
+    int nr_queued = 0;
+
+    int nr_events = epoll_wait(epoll_fd, events, POOL_EPOLL_BATCH, -1);
+    if (nr_events == -1) {
+        if (errno == EINTR) return true;
+        perror("epoll_wait");
+        return false;
+    }
+
+    for (int i = 0; i < nr_events; i++) {
+        void *tag = events[i].data.ptr;
+        if (tag == &stop_tag) {
+            return false;
+        }
+        if (tag == &wake_tag) {
+            uint64_t one;
+            if (read(wake_fd, &one, sizeof(one)) < 0) {
+                // Another idle worker took the wake up
+            }
+            continue;
+        }
+        struct pool_task *task = tag;
+        if (deque_push(&self->deque, task) == 0) {
+            nr_queued++;
+        } else {
+            task->run(task, &self->rx_pool);
+        }
+    }
+
+    // This worker runs one of the tasks, the others are up for stealing
+    if (nr_queued > 1 && nr_workers > 1) {
+        pool_signal(wake_fd, nr_queued - 1 < nr_workers - 1 ? nr_queued - 1 : nr_workers - 1);
+    }
+    return true;
+}
+
+static void *pool_worker_func(void *arg) {
+    struct pool_worker *self = arg;
+
+    while (keep_running) {
+        struct pool_task *task = deque_take(&self->deque);
+        if (!task) {
+            task = pool_steal(self);
+        }
+        if (task) {
+            task->run(task, &self->rx_pool);
+        } else if (!pool_wait(self)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int pool_ctl(int op, int fd, void *tag, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = tag;
+    return epoll_ctl(epoll_fd, op, fd, &ev);
+}
+
+int pool_add(struct pool_task *task) {
+    return pool_ctl(EPOLL_CTL_ADD, task->fd, task, EPOLLIN | EPOLLRDHUP | EPOLLONESHOT);
+}
+
+int pool_rearm(struct pool_task *task) {
+    return pool_ctl(EPOLL_CTL_MOD, task->fd, task, EPOLLIN | EPOLLRDHUP | EPOLLONESHOT);
+}
+
+int pool_rearm_writable(struct pool_task *task) {
+    return pool_ctl(EPOLL_CTL_MOD, task->fd, task, EPOLLOUT | EPOLLONESHOT);
+}
+
+void pool_complete(struct pool_task *task) {
+    struct pool_task *head = atomic_load_explicit(&done_head, memory_order_relaxed);
+    do {
+        task->next_done = head;
+    } while (!atomic_compare_exchange_weak_explicit(&done_head, &head, task,
+                                                    memory_order_release, memory_order_relaxed));
+    // Only the push onto an empty queue needs to wake the owner up
+    if (!head) {
+        pool_signal(done_fd, 1);
+    }
+}
+
+int pool_completion_fd(void) {
+    return done_fd;
+}
+
+struct pool_task *pool_reap(void) {
+    uint64_t count;
+    // Clear the eventfd first, a push after this signals it again
+    if (read(done_fd, &count, sizeof(count)) < 0) {
+        // Nothing signalled yet
+    }
+    return atomic_exchange_explicit(&done_head, NULL, memory_order_acquire);
+}
+
+void pool_stop(void) {
+    if (stop_fd != -1) {
+        pool_signal(stop_fd, 1);
+    }
+}
+
+static void pool_close_fds(void) {
+    int *fds[] = { &epoll_fd, &stop_fd, &wake_fd, &done_fd };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] != -1) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
+
+int pool_start(int count) {
+    workers = calloc(count, sizeof(struct pool_worker));
+    if (!workers) {
+        return -1;
+    }
+    nr_workers = count;
+    for (int i = 0; i < nr_workers; i++) {
+        workers[i].id = i;
+        rx_pool_init(&workers[i].rx_pool);
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC | EFD_SEMAPHORE);
+    done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd == -1 || stop_fd == -1 || wake_fd == -1 || done_fd == -1 ||
+        pool_ctl(EPOLL_CTL_ADD, stop_fd, &stop_tag, EPOLLIN) == -1 ||
+        pool_ctl(EPOLL_CTL_ADD, wake_fd, &wake_tag, EPOLLIN) == -1) {
+        goto fail;
+    }
+    if (!keep_running) pool_stop();
+
+    for (int i = 0; i < nr_workers; i++) {
+        // A worker that fails to start leaves an empty deque to steal from
+        int err = pthread_create(&workers[i].thread_id, NULL, pool_worker_func, &workers[i]);
+        if (err != 0) {
+            errno = err;
+            if (i > 0) break;
+            goto fail;
+        }
+        nr_started = i + 1;
+    }
+    return 0;
+
+fail:
+    pool_close_fds();
+    free(workers);
+    workers = NULL;
+    return -1;
+}
+
+void pool_join(void) {
+    for (int i = 0; i < nr_started; i++) {
+        pthread_join(workers[i].thread_id, NULL);
+    }
+    for (int i = 0; i < nr_workers; i++) {
+        rx_pool_destroy(&workers[i].rx_pool);
+    }
+    pool_close_fds();
+    free(workers);
+    workers = NULL;
+    nr_workers = 0;
+    nr_started = 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * pool.h
+ *
+ * Fixed pool of worker threads serving the clients of the default (non -e)
+ * mode. Each worker owns a Chase-Lev deque of tasks: the owner pushes and
+ * pops at the bottom, idle workers steal from the top. Tasks come from one
+ * epoll set shared by the pool. A task's descriptor is armed with
+ * EPOLLONESHOT, so readiness turns into exactly one queued task until the
+ * task re-arms it.
+ *
+ * Finished tasks are handed back to the thread that owns them through a
+ * lock-free completion queue, signalled on an eventfd it can poll.
+ */
+
+#ifndef AESDSOCKET_POOL_H
+#define AESDSOCKET_POOL_H
+
+#include "rxbuf.h"
+
+/**
+ * Tasks a worker deque holds, a power of two. A worker that finds its deque
+ * full runs the task right away.
+ */
+#define POOL_DEQUE_SIZE 1024
+/**
+ * Events a worker takes from the epoll set at once
+ */
+#define POOL_EPOLL_BATCH 16
+
+struct pool_task {
+    /**
+     * Run on a worker thread once @param task's descriptor is ready,
+     * with that worker's chunk pool. Ends by re-arming the task or by
+     * completing it.
+     */
+    void (*run)(struct pool_task *task, struct rx_pool *rx_pool);
+    int fd;
+    struct pool_task *next_done;  // completion queue link
+};
+
+/**
+ * Start @param nr_workers worker threads
+ * @return 0 on success, -1 with errno set on failure
+ */
+int pool_start(int nr_workers);
+
+/**
+ * Queue @param task the next time its fd becomes readable
+ * @return 0 on success, -1 with errno set on failure
+ */
+int pool_add(struct pool_task *task);
+
+/**
+ * Queue @param task again the next time its fd is readable, which may be
+ * right away if there is unread data. Only the task itself calls this.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int pool_rearm(struct pool_task *task);
+
+/**
+ * Queue @param task again once its fd is writable, for a task waiting for
+ * its client to take queued output. Only the task itself calls this.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int pool_rearm_writable(struct pool_task *task);
+
+/**
+ * Hand @param task back to its owner, see pool_reap(). The task must not
+ * touch it afterwards.
+ */
+void pool_complete(struct pool_task *task);
+
+/**
+ * @return a descriptor that polls readable while completed tasks wait
+ */
+int pool_completion_fd(void);
+
+/**
+ * Take every completed task, linked through next_done
+ */
+struct pool_task *pool_reap(void);
+
+/**
+ * Wake up the workers so they notice keep_running was cleared.
+ * Async-signal-safe.
+ */
+void pool_stop(void);
+
+/**
+ * Wait for the workers to exit once stopped, then release the pool. Tasks
+ * neither completed nor reaped are left to their owner.
+ */
+void pool_join(void);
+
+#endif /* AESDSOCKET_POOL_H */
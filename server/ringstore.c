@@ -0,0 +1,233 @@
+/*
+ * ringstore.c
+ *
+ * In-process aesd_circular_buffer backend, see ringstore.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "aesdsocket.h"
+#include "framing.h"
+#include "ringstore.h"
+
+// Lines of a batch whose entries are built on the stack
+#define RINGSTORE_STACK_LINES 16
+
+int ringstore_init(struct ringstore *ring, unsigned int capacity) {
+    int rc = aesd_circular_buffer_init_capacity(&ring->buffer, capacity);
+    if (rc < 0) {
+        errno = -rc;
+        return -1;
+    }
+    pthread_mutex_init(&ring->lock, NULL);
+    return 0;
+}
+
+/**
+ * Copy up to @param len bytes starting @param pos bytes after the start of
+ * the oldest entry into @param buf. Called with the lock held.
+ * @return the number of bytes copied
+ */
+static size_t ringstore_copy_locked(struct ringstore *ring, size_t pos, char *buf, size_t len) {
+    size_t copied = 0;
+
+    while (copied < len) {
+        size_t entry_offset;
+        struct aesd_buffer_entry *entry =
+            aesd_circular_buffer_find_entry_offset_for_fpos(&ring->buffer, pos + copied, &entry_offset);
+        if (!entry) break;
+
+        size_t chunk = entry->size - entry_offset;
+        if (chunk > len - copied) chunk = len - copied;
+        memcpy(buf + copied, entry->buffptr + entry_offset, chunk);
+        copied += chunk;
+    }
+    return copied;
+}
+
+/**
+ * Copy everything from @param pos on, then drop the lock and pass the copy
+ * to @param reply, so a slow client never holds up the other ones
+ */
+static int ringstore_reply_unlock(struct ringstore *ring, size_t pos, const struct reply_ops *reply, void *ctx) {
+    size_t size = aesd_circular_buffer_size(&ring->buffer);
+    size_t len = 0;
+    char *buf = NULL;
+    int retval = 0;
+
+    if (pos < size) {
+        buf = malloc(size - pos);
+        if (buf) len = ringstore_copy_locked(ring, pos, buf, size - pos);
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    if (pos < size && !buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (len > 0) {
+        retval = reply->data(ctx, buf, len);
+    }
+    free(buf);
+    return retval;
+}
+
+/**
+ * Split the @param len bytes at @param data into one entry per line. A
+ * single line keeps @param data as its buffer, otherwise each line gets a
+ * copy and @param data is left to the caller.
+ * @return the number of entries, -1 if out of memory
+ */
+static int ringstore_split(char *data, size_t len, struct aesd_buffer_entry **entries_rtn,
+                           struct aesd_buffer_entry *stack_entries) {
+    struct aesd_buffer_entry *entries = stack_entries;
+    int nr_lines = 0;
+    size_t pos = 0;
+
+    while (pos < len) {
+        const char *newline = frame_find_newline(data + pos, len - pos);
+        pos = newline ? (size_t)(newline - data) + 1 : len;
+        nr_lines++;
+    }
+
+    if (nr_lines == 1) {
+        entries[0].buffptr = data;
+        entries[0].size = len;
+        *entries_rtn = entries;
+        return 1;
+    }
+    if (nr_lines > RINGSTORE_STACK_LINES) {
+        entries = malloc(nr_lines * sizeof(struct aesd_buffer_entry));
+        if (!entries) return -1;
+    }
+
+    pos = 0;
+    for (int i = 0; i < nr_lines; i++) {
+        const char *newline = frame_find_newline(data + pos, len - pos);
+        size_t line_len = newline ? (size_t)(newline - data) + 1 - pos : len - pos;
+        char *line = malloc(line_len);
+        if (!line) {
+            while (i-- > 0) free((char *)entries[i].buffptr);
+            if (entries != stack_entries) free(entries);
+            return -1;
+        }
+        memcpy(line, data + pos, line_len);
+        entries[i].buffptr = line;
+        entries[i].size = line_len;
+        pos += line_len;
+    }
+    *entries_rtn = entries;
+    return nr_lines;
+}
+
+int ringstore_appendv(struct ringstore *ring, const struct iovec *iov, int iovcnt, size_t len,
+                      const struct reply_ops *reply, void *ctx) {
+    struct aesd_buffer_entry stack_entries[RINGSTORE_STACK_LINES];
+    struct aesd_buffer_entry *entries = stack_entries;
+    int nr_entries = 0;
+
+    // Entries are built before taking the lock, which only covers the ring
+    char *data = NULL;
+    if (len > 0) {
+        data = malloc(len);
+        if (!data) {
+            errno = ENOMEM;
+            return -1;
+        }
+        iov_copy_prefix(iov, iovcnt, data, len);
+        nr_entries = ringstore_split(data, len, &entries, stack_entries);
+        if (nr_entries == -1) {
+            free(data);
+            errno = ENOMEM;
+            return -1;
+        }
+        if (nr_entries > 1) {
+            free(data);
+        }
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    for (int i = 0; i < nr_entries; i++) {
+        free((char *)aesd_circular_buffer_add_entry(&ring->buffer, &entries[i]));
+    }
+    if (nr_entries > 0 && entries != stack_entries) {
+        free(entries);
+    }
+
+    if (reply) {
+        return ringstore_reply_unlock(ring, 0, reply, ctx);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return 0;
+}
+
+int ringstore_seekto(struct ringstore *ring, const struct aesd_seekto *seekto,
+                     const struct reply_ops *reply, void *ctx) {
+    struct aesd_buffer_entry *entry;
+    size_t entry_start;
+
+    // write_cmd counts from the oldest entry, the offset must fall within it
+    pthread_mutex_lock(&ring->lock);
+    entry = aesd_circular_buffer_get_entry(&ring->buffer, seekto->write_cmd, &entry_start);
+    if (!entry || seekto->write_cmd_offset >= entry->size) {
+        pthread_mutex_unlock(&ring->lock);
+        errno = EINVAL;
+        return -1;
+    }
+    return ringstore_reply_unlock(ring, entry_start + seekto->write_cmd_offset, reply, ctx);
+}
+
+int ringstore_readv(struct ringstore *ring, struct aesd_readv_desc *descs, int nr_descs,
+                    const struct reply_ops *reply, void *ctx) {
+    size_t total = 0;
+    size_t len = 0;
+    int retval = 0;
+
+    for (int i = 0; i < nr_descs; i++) {
+        total += descs[i].length;
+    }
+    if (total > READV_REPLY_MAX) total = READV_REPLY_MAX;
+
+    char *buf = malloc(total ? total : 1);
+    if (!buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // All ranges come from the same state of the ring
+    pthread_mutex_lock(&ring->lock);
+    for (int i = 0; i < nr_descs; i++) {
+        struct aesd_buffer_entry *entry;
+        size_t entry_start;
+
+        entry = aesd_circular_buffer_get_entry(&ring->buffer, descs[i].write_cmd, &entry_start);
+        if (!entry || descs[i].write_cmd_offset >= entry->size) {
+            descs[i].result = -EINVAL;
+            continue;
+        }
+        size_t want = descs[i].length;
+        if (want > total - len) want = total - len;
+        descs[i].result = ringstore_copy_locked(ring, entry_start + descs[i].write_cmd_offset,
+                                                buf + len, want);
+        len += descs[i].result;
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    if (len > 0) {
+        retval = reply->data(ctx, buf, len);
+    }
+    free(buf);
+    return retval;
+}
+
+void ringstore_destroy(struct ringstore *ring) {
+    struct aesd_buffer_entry *entry;
+    uint8_t index;
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &ring->buffer, index) {
+        free((char *)entry->buffptr);
+    }
+    aesd_circular_buffer_release(&ring->buffer);
+    pthread_mutex_destroy(&ring->lock);
+}
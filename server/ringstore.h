@@ -0,0 +1,71 @@
+/*
+ * ringstore.h
+ *
+ * In-process backend selected with -b ring: the aesd_circular_buffer of the
+ * char driver, built for userspace and guarded by a mutex. It behaves like
+ * /dev/aesdchar, with the newest AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+ * lines kept as one entry each and AESDCHAR_IOCSEEKTO/AESDCHAR_IOCREADV
+ * answered from them, but a packet costs no syscall to store. It also serves
+ * hosts where aesdchar.ko can't be loaded.
+ */
+
+#ifndef AESDSOCKET_RINGSTORE_H
+#define AESDSOCKET_RINGSTORE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+struct reply_ops;
+
+struct ringstore {
+    pthread_mutex_t lock;
+    /**
+     * Entries point to malloc()ed lines, freed once overwritten
+     */
+    struct aesd_circular_buffer buffer;
+};
+
+/**
+ * Set up @param ring to keep the newest @param capacity lines
+ * @return 0 on success, -1 with errno set on failure
+ */
+int ringstore_init(struct ringstore *ring, unsigned int capacity);
+
+/**
+ * Add each newline terminated line of the @param len bytes gathered in
+ * @param iov as an entry, like one write() per line to the device. Bytes
+ * after the last newline become an entry of their own. If @param reply is
+ * not NULL, pass it everything held right after the append, as a read of
+ * the device would.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int ringstore_appendv(struct ringstore *ring, const struct iovec *iov, int iovcnt, size_t len,
+                      const struct reply_ops *reply, void *ctx);
+
+/**
+ * Pass what a read after AESDCHAR_IOCSEEKTO with @param seekto returns to
+ * @param reply
+ * @return 0 on success, -1 with errno set to EINVAL if @param seekto is out
+ * of range or to ENOMEM
+ */
+int ringstore_seekto(struct ringstore *ring, const struct aesd_seekto *seekto,
+                     const struct reply_ops *reply, void *ctx);
+
+/**
+ * Pass the ranges of an AESDCHAR_IOCREADV command back to back to @param
+ * reply, at most READV_REPLY_MAX bytes, setting each descriptor's result
+ * as the driver does
+ * @return 0 on success, -1 with errno set on failure
+ */
+int ringstore_readv(struct ringstore *ring, struct aesd_readv_desc *descs, int nr_descs,
+                    const struct reply_ops *reply, void *ctx);
+
+/**
+ * Free every entry held by @param ring
+ */
+void ringstore_destroy(struct ringstore *ring);
+
+#endif /* AESDSOCKET_RINGSTORE_H */
@@ -0,0 +1,257 @@
+/*
+ * rxbuf.c
+ *
+ * Chunked receive buffers, see rxbuf.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "rxbuf.h"
+
+// Linux UIO_MAXIOV, the most buffers one writev() accepts
+#define RX_IOV_BATCH 1024
+
+void rx_pool_init(struct rx_pool *pool) {
+    pool->free_list = NULL;
+    pool->nr_free = 0;
+}
+
+void rx_pool_destroy(struct rx_pool *pool) {
+    while (pool->free_list) {
+        struct rx_chunk *chunk = pool->free_list;
+        pool->free_list = chunk->next;
+        free(chunk);
+    }
+    pool->nr_free = 0;
+}
+
+static struct rx_chunk *rx_chunk_get(struct rx_pool *pool) {
+    struct rx_chunk *chunk = pool->free_list;
+    if (chunk) {
+        pool->free_list = chunk->next;
+        pool->nr_free--;
+    } else {
+        chunk = malloc(sizeof(struct rx_chunk));
+        if (!chunk) return NULL;
+    }
+    chunk->next = NULL;
+    return chunk;
+}
+
+static void rx_chunk_put(struct rx_pool *pool, struct rx_chunk *chunk) {
+    if (pool->nr_free >= RX_POOL_MAX_FREE) {
+        free(chunk);
+        return;
+    }
+    chunk->next = pool->free_list;
+    pool->free_list = chunk;
+    pool->nr_free++;
+}
+
+void rx_packet_init(struct rx_packet *packet) {
+    memset(packet, 0, sizeof(struct rx_packet));
+    packet->view_index = -1;
+}
+
+static void rx_packet_unview(struct rx_packet *packet) {
+    if (packet->view_index >= 0) {
+        packet->iov[packet->view_index].iov_len = packet->view_saved_len;
+        packet->view_index = -1;
+    }
+}
+
+void rx_packet_reset(struct rx_packet *packet, struct rx_pool *pool) {
+    rx_packet_unview(packet);
+    while (packet->head) {
+        struct rx_chunk *chunk = packet->head;
+        packet->head = chunk->next;
+        rx_chunk_put(pool, chunk);
+    }
+    packet->tail = NULL;
+    packet->iovcnt = 0;
+    packet->len = 0;
+}
+
+void rx_packet_destroy(struct rx_packet *packet, struct rx_pool *pool) {
+    rx_packet_reset(packet, pool);
+    free(packet->iov);
+    packet->iov = NULL;
+    packet->iov_cap = 0;
+}
+
+char *rx_packet_reserve(struct rx_packet *packet, struct rx_pool *pool, size_t *space_rtn) {
+    if (packet->tail) {
+        // The tail chunk may start part way in after rx_packet_consume()
+        struct iovec *last = &packet->iov[packet->iovcnt - 1];
+        char *next = (char *)last->iov_base + last->iov_len;
+        char *chunk_end = packet->tail->data + RX_CHUNK_DATA_SIZE;
+        if (next < chunk_end) {
+            *space_rtn = chunk_end - next;
+            return next;
+        }
+    }
+
+    if (packet->iovcnt == packet->iov_cap) {
+        int new_cap = packet->iov_cap ? packet->iov_cap * 2 : 8;
+        struct iovec *new_iov = realloc(packet->iov, new_cap * sizeof(struct iovec));
+        if (!new_iov) return NULL;
+        packet->iov = new_iov;
+        packet->iov_cap = new_cap;
+    }
+    struct rx_chunk *chunk = rx_chunk_get(pool);
+    if (!chunk) return NULL;
+
+    if (packet->tail) {
+        packet->tail->next = chunk;
+    } else {
+        packet->head = chunk;
+    }
+    packet->tail = chunk;
+    packet->iov[packet->iovcnt].iov_base = chunk->data;
+    packet->iov[packet->iovcnt].iov_len = 0;
+    packet->iovcnt++;
+
+    *space_rtn = RX_CHUNK_DATA_SIZE;
+    return chunk->data;
+}
+
+void rx_packet_commit(struct rx_packet *packet, size_t len) {
+    packet->iov[packet->iovcnt - 1].iov_len += len;
+    packet->len += len;
+}
+
+int rx_packet_append(struct rx_packet *packet, struct rx_pool *pool, const char *buf, size_t len) {
+    while (len > 0) {
+        size_t space;
+        char *dst = rx_packet_reserve(packet, pool, &space);
+        if (!dst) return -1;
+        if (space > len) space = len;
+        memcpy(dst, buf, space);
+        rx_packet_commit(packet, space);
+        buf += space;
+        len -= space;
+    }
+    return 0;
+}
+
+ssize_t rx_packet_recv(struct rx_packet *packet, struct rx_pool *pool, int fd, int flags) {
+    size_t space;
+    char *dst = rx_packet_reserve(packet, pool, &space);
+    if (!dst) {
+        errno = ENOMEM;
+        return -1;
+    }
+    ssize_t bytes_received = recv(fd, dst, space, flags);
+    if (bytes_received > 0) {
+        rx_packet_commit(packet, bytes_received);
+    }
+    return bytes_received;
+}
+
+const struct iovec *rx_packet_view(struct rx_packet *packet, size_t len, int *iovcnt_rtn) {
+    int i = 0;
+
+    rx_packet_unview(packet);
+    while (i < packet->iovcnt && len > packet->iov[i].iov_len) {
+        len -= packet->iov[i].iov_len;
+        i++;
+    }
+    if (i == packet->iovcnt) {
+        *iovcnt_rtn = packet->iovcnt;
+        return packet->iov;
+    }
+    packet->view_index = i;
+    packet->view_saved_len = packet->iov[i].iov_len;
+    packet->iov[i].iov_len = len;
+    *iovcnt_rtn = i + 1;
+    return packet->iov;
+}
+
+void rx_packet_consume(struct rx_packet *packet, struct rx_pool *pool, size_t len) {
+    int dropped = 0;
+
+    rx_packet_unview(packet);
+    if (len >= packet->len) {
+        rx_packet_reset(packet, pool);
+        return;
+    }
+    packet->len -= len;
+    while (len > 0 && len >= packet->iov[dropped].iov_len) {
+        struct rx_chunk *chunk = packet->head;
+        len -= packet->iov[dropped].iov_len;
+        packet->head = chunk->next;
+        rx_chunk_put(pool, chunk);
+        dropped++;
+    }
+    if (dropped > 0) {
+        memmove(packet->iov, packet->iov + dropped, (packet->iovcnt - dropped) * sizeof(struct iovec));
+        packet->iovcnt -= dropped;
+    }
+    packet->iov[0].iov_base = (char *)packet->iov[0].iov_base + len;
+    packet->iov[0].iov_len -= len;
+}
+
+size_t rx_packet_copy_at(const struct rx_packet *packet, size_t offset, char *buf, size_t len) {
+    size_t copied = 0;
+
+    for (int i = 0; i < packet->iovcnt && copied < len; i++) {
+        size_t n = packet->iov[i].iov_len;
+        if (offset >= n) {
+            offset -= n;
+            continue;
+        }
+        n -= offset;
+        if (n > len - copied) n = len - copied;
+        memcpy(buf + copied, (const char *)packet->iov[i].iov_base + offset, n);
+        copied += n;
+        offset = 0;
+    }
+    return copied;
+}
+
+size_t iov_copy_prefix(const struct iovec *iov, int iovcnt, char *buf, size_t len) {
+    size_t copied = 0;
+    for (int i = 0; i < iovcnt && copied < len; i++) {
+        size_t n = iov[i].iov_len;
+        if (n > len - copied) n = len - copied;
+        memcpy(buf + copied, iov[i].iov_base, n);
+        copied += n;
+    }
+    return copied;
+}
+
+int iov_write_all(int fd, const struct iovec *iov, int iovcnt, off_t offset, size_t *written_rtn) {
+    struct iovec cur[RX_IOV_BATCH];
+    int idx = 0;
+    size_t skip = 0;  // bytes of iov[idx] already written
+    size_t written = 0;
+
+    while (idx < iovcnt) {
+        int n = 0;
+        for (int i = idx; i < iovcnt && n < RX_IOV_BATCH; i++, n++) {
+            cur[n] = iov[i];
+        }
+        cur[0].iov_base = (char *)cur[0].iov_base + skip;
+        cur[0].iov_len -= skip;
+
+        ssize_t rc = offset < 0 ? writev(fd, cur, n) : pwritev(fd, cur, n, offset);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            if (written_rtn) *written_rtn = written;
+            return -1;
+        }
+        if (offset >= 0) offset += rc;
+        written += rc;
+        rc += skip;
+        while (idx < iovcnt && (size_t)rc >= iov[idx].iov_len) {
+            rc -= iov[idx].iov_len;
+            idx++;
+        }
+        skip = rc;
+    }
+    if (written_rtn) *written_rtn = written;
+    return 0;
+}
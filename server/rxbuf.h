@@ -0,0 +1,137 @@
+/*
+ * rxbuf.h
+ *
+ * Receive side packet assembly. Bytes are received straight into fixed size
+ * chunks taken from a per-worker pool and chained into the packet being
+ * assembled, so a packet never gets reallocated or copied as it grows. The
+ * chained chunks are described by an iovec array that the append path hands
+ * to writev() as is.
+ */
+
+#ifndef AESDSOCKET_RXBUF_H
+#define AESDSOCKET_RXBUF_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define RX_CHUNK_SIZE 4096
+/**
+ * Free chunks a pool keeps for reuse, the rest go back to the heap
+ */
+#define RX_POOL_MAX_FREE 64
+
+struct rx_chunk {
+    struct rx_chunk *next;
+    char data[RX_CHUNK_SIZE - sizeof(struct rx_chunk *)];
+};
+
+#define RX_CHUNK_DATA_SIZE (sizeof(((struct rx_chunk *)0)->data))
+
+/**
+ * Cache of free chunks. Not thread safe: each worker thread owns one.
+ */
+struct rx_pool {
+    struct rx_chunk *free_list;
+    size_t nr_free;
+};
+
+struct rx_packet {
+    struct rx_chunk *head;
+    struct rx_chunk *tail;
+    /**
+     * One entry per chunk of the packet, iov[iovcnt - 1] is the tail
+     */
+    struct iovec *iov;
+    int iovcnt;
+    int iov_cap;
+    /**
+     * Total number of bytes in the packet
+     */
+    size_t len;
+    /**
+     * iov entry shortened by rx_packet_view(), -1 if none, and its real length
+     */
+    int view_index;
+    size_t view_saved_len;
+};
+
+void rx_pool_init(struct rx_pool *pool);
+void rx_pool_destroy(struct rx_pool *pool);
+
+void rx_packet_init(struct rx_packet *packet);
+
+/**
+ * Return the chunks of @param packet to @param pool and empty it
+ */
+void rx_packet_reset(struct rx_packet *packet, struct rx_pool *pool);
+
+/**
+ * Release everything held by @param packet
+ */
+void rx_packet_destroy(struct rx_packet *packet, struct rx_pool *pool);
+
+/**
+ * Make room for more data at the end of @param packet, chaining a new chunk
+ * from @param pool when the tail chunk is full.
+ * @param space_rtn receives the number of bytes available at the returned pointer
+ * @return where the next received bytes go, NULL if out of memory
+ */
+char *rx_packet_reserve(struct rx_packet *packet, struct rx_pool *pool, size_t *space_rtn);
+
+/**
+ * Account for @param len bytes written at the pointer rx_packet_reserve() returned
+ */
+void rx_packet_commit(struct rx_packet *packet, size_t len);
+
+/**
+ * Copy @param len bytes from @param buf to the end of @param packet
+ * @return 0 on success, -1 if out of memory
+ */
+int rx_packet_append(struct rx_packet *packet, struct rx_pool *pool, const char *buf, size_t len);
+
+/**
+ * Receive once from @param fd into @param packet.
+ * @return the recv() result: bytes received, 0 on orderly shutdown or -1
+ * with errno set (ENOMEM if no chunk could be allocated)
+ */
+ssize_t rx_packet_recv(struct rx_packet *packet, struct rx_pool *pool, int fd, int flags);
+
+/**
+ * Describe the first @param len bytes of @param packet. The returned array is
+ * the packet's own, with its last entry shortened until the next call into
+ * this module for @param packet.
+ * @param iovcnt_rtn receives the number of entries
+ */
+const struct iovec *rx_packet_view(struct rx_packet *packet, size_t len, int *iovcnt_rtn);
+
+/**
+ * Drop the first @param len bytes of @param packet, returning emptied chunks
+ * to @param pool. Used to keep the partial line that follows the last
+ * complete one.
+ */
+void rx_packet_consume(struct rx_packet *packet, struct rx_pool *pool, size_t len);
+
+/**
+ * Copy up to @param len bytes starting @param offset bytes into @param packet
+ * @return the number of bytes copied
+ */
+size_t rx_packet_copy_at(const struct rx_packet *packet, size_t offset, char *buf, size_t len);
+
+/**
+ * Copy up to @param len bytes from the start of an iovec list into @param buf
+ * @return the number of bytes copied
+ */
+size_t iov_copy_prefix(const struct iovec *iov, int iovcnt, char *buf, size_t len);
+
+/**
+ * Write all of @param iov to @param fd, resuming after short writes, with
+ * pwritev() at @param offset or with writev() if @param offset is negative
+ * @param written_rtn if not NULL, receives the number of bytes written, all
+ * of them on success and those written ahead of the failure otherwise
+ * @return 0 on success, -1 with errno set on failure
+ */
+int iov_write_all(int fd, const struct iovec *iov, int iovcnt, off_t offset, size_t *written_rtn);
+
+#endif /* AESDSOCKET_RXBUF_H */
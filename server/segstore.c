@@ -0,0 +1,552 @@
+/*
+ * segstore.c
+ *
+ * Segmented, memory mapped persistent store, see segstore.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "aesdsocket.h"
+#include "segstore.h"
+
+static struct segment *segment_alloc(unsigned int id) {
+    struct segment *seg = calloc(1, sizeof(struct segment));
+    if (!seg) return NULL;
+    seg->id = id;
+    atomic_init(&seg->refs, 1);
+    seg->fd = -1;
+    seg->index_fd = -1;
+    return seg;
+}
+
+static void segment_free(struct segment *seg) {
+    if (seg->map) munmap(seg->map, seg->size);
+    if (seg->fd != -1) close(seg->fd);
+    if (seg->index_fd != -1) close(seg->index_fd);
+    free(seg->ends);
+    free(seg);
+}
+
+void segment_put(struct segment *seg) {
+    if (atomic_fetch_sub_explicit(&seg->refs, 1, memory_order_acq_rel) == 1) {
+        segment_free(seg);
+    }
+}
+
+static int segment_map(struct segment *seg) {
+    seg->map = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED) {
+        seg->map = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int segment_open_files(struct segstore *store, struct segment *seg, int flags) {
+    char name[32];
+
+    snprintf(name, sizeof(name), "%08u.seg", seg->id);
+    seg->fd = openat(store->dir_fd, name, O_RDWR | O_CLOEXEC | flags, 0666);
+    if (seg->fd == -1) return -1;
+    snprintf(name, sizeof(name), "%08u.idx", seg->id);
+    seg->index_fd = openat(store->dir_fd, name, O_RDWR | O_CLOEXEC | flags, 0666);
+    return seg->index_fd == -1 ? -1 : 0;
+}
+
+/**
+ * Record @param end as the end of the next record of @param seg. Called with
+ * the store lock held.
+ */
+static int segment_index_record(struct segment *seg, uint32_t end) {
+    if (seg->nr_records == seg->records_cap) {
+        size_t new_cap = seg->records_cap ? seg->records_cap * 2 : 64;
+        uint32_t *new_ends = realloc(seg->ends, new_cap * sizeof(uint32_t));
+        if (!new_ends) {
+            errno = ENOMEM;
+            return -1;
+        }
+        seg->ends = new_ends;
+        seg->records_cap = new_cap;
+    }
+    seg->ends[seg->nr_records++] = end;
+    return 0;
+}
+
+/**
+ * Open segment @param id and rebuild its record index from the index file
+ * alone. Entries from the first one out of order or past the end of the
+ * segment on were torn by a crash and are dropped.
+ */
+static struct segment *segment_load(struct segstore *store, unsigned int id) {
+    struct segment *seg = segment_alloc(id);
+    struct stat seg_st, index_st;
+    uint32_t prev = 0;
+    size_t nr = 0;
+
+    if (!seg) return NULL;
+    if (segment_open_files(store, seg, 0) == -1 ||
+        fstat(seg->fd, &seg_st) == -1 || fstat(seg->index_fd, &index_st) == -1) {
+        goto fail;
+    }
+    seg->size = seg_st.st_size;
+
+    if (index_st.st_size >= (off_t)sizeof(uint32_t)) {
+        seg->records_cap = index_st.st_size / sizeof(uint32_t);
+        seg->ends = malloc(seg->records_cap * sizeof(uint32_t));
+        if (!seg->ends) goto fail;
+        ssize_t rc = pread(seg->index_fd, seg->ends, seg->records_cap * sizeof(uint32_t), 0);
+        if (rc < 0) goto fail;
+        nr = rc / sizeof(uint32_t);
+    }
+    while (seg->nr_records < nr && seg->ends[seg->nr_records] > prev &&
+           seg->ends[seg->nr_records] <= seg->size) {
+        prev = seg->ends[seg->nr_records++];
+    }
+    if ((off_t)(seg->nr_records * sizeof(uint32_t)) != index_st.st_size &&
+        ftruncate(seg->index_fd, seg->nr_records * sizeof(uint32_t)) == -1) {
+        goto fail;
+    }
+    seg->nr_synced = seg->nr_records;
+    seg->used = prev;
+
+    // A crash right after creating a segment can leave it empty, appends
+    // then roll over to a new one
+    if (seg->size > 0 && segment_map(seg) == -1) goto fail;
+    return seg;
+
+fail:
+    segment_free(seg);
+    return NULL;
+}
+
+/**
+ * @return the @param i th oldest retained segment. Called with the store lock held.
+ */
+static inline struct segment *segstore_seg(struct segstore *store, size_t i) {
+    return store->segs[(store->seg_head + i) % SEGSTORE_MAX_SEGMENTS];
+}
+
+/**
+ * Start a new segment that fits a @param len byte record after the last one.
+ * Called with the store lock held.
+ */
+static struct segment *segstore_roll(struct segstore *store, size_t len) {
+    struct segment *last = store->nr_segs ? segstore_seg(store, store->nr_segs - 1) : NULL;
+    struct segment *seg;
+    int rc;
+
+    if (store->nr_segs == SEGSTORE_MAX_SEGMENTS) {
+        errno = ENOSPC;
+        return NULL;
+    }
+    seg = segment_alloc(last ? last->id + 1 : 0);
+    if (!seg) return NULL;
+    seg->size = len > SEGSTORE_SEGMENT_SIZE ? len : SEGSTORE_SEGMENT_SIZE;
+    seg->base = last ? last->base + last->used : 0;
+
+    if (segment_open_files(store, seg, O_CREAT | O_TRUNC) == -1) goto fail;
+    // Allocate the blocks now: running out of space while storing through
+    // the mapping would be a SIGBUS
+    rc = posix_fallocate(seg->fd, 0, seg->size);
+    if (rc != 0) {
+        errno = rc;
+        goto fail;
+    }
+    if (segment_map(seg) == -1) goto fail;
+
+    if (last) last->next = seg;
+    store->segs[(store->seg_head + store->nr_segs) % SEGSTORE_MAX_SEGMENTS] = seg;
+    store->nr_segs++;
+    store->dir_dirty = true;
+    return seg;
+
+fail:
+    rc = errno;
+    segment_free(seg);
+    errno = rc;
+    return NULL;
+}
+
+/**
+ * Delete the oldest segment, its mapping goes away with the last reply
+ * still sending from it. Called with the store lock held.
+ */
+static void segstore_retire(struct segstore *store) {
+    struct segment *seg = segstore_seg(store, 0);
+    char name[32];
+
+    store->segs[store->seg_head] = NULL;
+    store->seg_head = (store->seg_head + 1) % SEGSTORE_MAX_SEGMENTS;
+    store->nr_segs--;
+    store->trimmed = 0;
+
+    // Index first: recovery only looks for segments that have one
+    snprintf(name, sizeof(name), "%08u.idx", seg->id);
+    unlinkat(store->dir_fd, name, 0);
+    snprintf(name, sizeof(name), "%08u.seg", seg->id);
+    unlinkat(store->dir_fd, name, 0);
+    segment_put(seg);
+}
+
+/**
+ * Drop the oldest records until the retention limits hold again, like
+ * aesd_circular_buffer_add_entry() overwriting the oldest entry. Called with
+ * the store lock held.
+ */
+static void segstore_trim(struct segstore *store) {
+    for (;;) {
+        struct segment *first = segstore_seg(store, 0);
+        if (store->trimmed == first->nr_records && store->nr_segs > 1) {
+            segstore_retire(store);
+            continue;
+        }
+        if (store->nr_retained <= 1 ||
+            !((store->max_records && store->nr_retained > store->max_records) ||
+              (store->max_bytes && store->length - store->start > store->max_bytes))) {
+            break;
+        }
+        store->start = first->base + first->ends[store->trimmed++];
+        store->nr_retained--;
+    }
+}
+
+static void segstore_sync_fd(int fd, const char *what) {
+    if (fdatasync(fd) == -1) {
+        syslog(LOG_ERR, "fdatasync of %s failed: %s", what, strerror(errno));
+    }
+}
+
+/**
+ * Most segments one group commit covers, the rest wait for the next round
+ */
+#define SEGSTORE_SYNC_BATCH 64
+
+/**
+ * Group commit: sync the data appended since the last round, then write and
+ * sync the index entries describing it, so an index entry never refers to
+ * data that isn't on disk.
+ */
+static void *segstore_flusher(void *arg) {
+    struct segstore *store = arg;
+    struct segment *batch[SEGSTORE_SYNC_BATCH];
+    struct timespec next = { 0 };
+
+    pthread_mutex_lock(&store->lock);
+    for (;;) {
+        while (!store->stopping && store->length == atomic_load(&store->durable)) {
+            pthread_cond_wait(&store->flush_cond, &store->lock);
+        }
+        if (store->length == atomic_load(&store->durable)) {
+            break;  // stopping with nothing pending
+        }
+        if (!store->stopping && store->sync_interval_ms) {
+            // Appends arriving meanwhile join this commit
+            pthread_mutex_unlock(&store->lock);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {
+            }
+            pthread_mutex_lock(&store->lock);
+        }
+
+        // Segments may be retired while they are synced, the batch holds
+        // references to them
+        size_t nr = 0;
+        for (size_t i = 0; i < store->nr_segs && nr < SEGSTORE_SYNC_BATCH; i++) {
+            struct segment *seg = segstore_seg(store, i);
+            if (seg->id >= store->sync_id) {
+                atomic_fetch_add(&seg->refs, 1);
+                batch[nr++] = seg;
+            }
+        }
+        if (nr == 0) {
+            // Retention retired every segment left to sync, nothing to wait for
+            atomic_store_explicit(&store->durable, store->length, memory_order_release);
+            pthread_cond_broadcast(&store->durable_cond);
+            continue;
+        }
+        struct segment *last = batch[nr - 1];
+        unsigned int last_id = last->id;
+        size_t last_nr = last->nr_records;
+        off_t target = last->next ? last->base + (off_t)last->used : store->length;
+        bool dir_dirty = store->dir_dirty;
+        store->dir_dirty = false;
+        pthread_mutex_unlock(&store->lock);
+
+        if (dir_dirty) {
+            segstore_sync_fd(store->dir_fd, SEGSTORE_DIR);
+        }
+        for (size_t i = 0; i < nr; i++) {
+            segstore_sync_fd(batch[i]->fd, "segment");
+        }
+
+        // Only the last segment can grow meanwhile, the lock keeps its
+        // record index from being reallocated under the write
+        pthread_mutex_lock(&store->lock);
+        for (size_t i = 0; i < nr; i++) {
+            struct segment *seg = batch[i];
+            size_t nr_records = seg == last ? last_nr : seg->nr_records;
+            size_t len = (nr_records - seg->nr_synced) * sizeof(uint32_t);
+            if (len > 0 && pwrite(seg->index_fd, seg->ends + seg->nr_synced, len,
+                                  seg->nr_synced * sizeof(uint32_t)) != (ssize_t)len) {
+                syslog(LOG_ERR, "index write of segment %u failed", seg->id);
+            }
+            seg->nr_synced = nr_records;
+        }
+        pthread_mutex_unlock(&store->lock);
+
+        for (size_t i = 0; i < nr; i++) {
+            segstore_sync_fd(batch[i]->index_fd, "segment index");
+            segment_put(batch[i]);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        next.tv_nsec += (long)(store->sync_interval_ms % 1000) * 1000000;
+        next.tv_sec += store->sync_interval_ms / 1000 + next.tv_nsec / 1000000000;
+        next.tv_nsec %= 1000000000;
+
+        pthread_mutex_lock(&store->lock);
+        store->sync_id = last_id;
+        atomic_store_explicit(&store->durable, target, memory_order_release);
+        pthread_cond_broadcast(&store->durable_cond);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return NULL;
+}
+
+static int segstore_cmp_id(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a;
+    unsigned int y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Load every segment found in the store directory, in id order, then apply
+ * the retention limits to them
+ */
+static int segstore_recover(struct segstore *store) {
+    unsigned int ids[SEGSTORE_MAX_SEGMENTS];
+    size_t nr_ids = 0;
+    struct dirent *de;
+    struct segment *prev = NULL;
+    int fd = dup(store->dir_fd);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+
+    if (!dir) {
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        unsigned int id;
+        char name[32];
+        if (sscanf(de->d_name, "%u.idx", &id) != 1) continue;
+        snprintf(name, sizeof(name), "%08u.idx", id);
+        if (strcmp(name, de->d_name) != 0) continue;
+        if (nr_ids == SEGSTORE_MAX_SEGMENTS) {
+            closedir(dir);
+            errno = ENOSPC;
+            return -1;
+        }
+        ids[nr_ids++] = id;
+    }
+    closedir(dir);
+    qsort(ids, nr_ids, sizeof(unsigned int), segstore_cmp_id);
+
+    for (size_t i = 0; i < nr_ids; i++) {
+        struct segment *seg = segment_load(store, ids[i]);
+        if (!seg) {
+            syslog(LOG_ERR, "can't load segment %08u: %s", ids[i], strerror(errno));
+            return -1;
+        }
+        seg->base = store->length;
+        store->length += seg->used;
+        store->nr_retained += seg->nr_records;
+        if (prev) prev->next = seg;
+        prev = seg;
+        store->segs[store->nr_segs++] = seg;
+    }
+    store->sync_id = prev ? prev->id : 0;
+    atomic_store(&store->durable, store->length);
+    if (store->nr_segs > 0) {
+        segstore_trim(store);
+    }
+    syslog(LOG_INFO, "recovered %zu records, %lld bytes retained in %zu segments",
+           store->nr_retained, (long long)(store->length - store->start), store->nr_segs);
+    return 0;
+}
+
+int segstore_open(struct segstore *store, const char *dir, unsigned int sync_interval_ms,
+                  off_t max_bytes, size_t max_records) {
+    int rc;
+
+    memset(store, 0, sizeof(struct segstore));
+    store->sync_interval_ms = sync_interval_ms;
+    store->max_bytes = max_bytes;
+    store->max_records = max_records;
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST) {
+        store->dir_fd = -1;
+        return -1;
+    }
+    store->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (store->dir_fd == -1) {
+        return -1;
+    }
+    if (segstore_recover(store) == -1) {
+        goto fail;
+    }
+
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_cond_init(&store->flush_cond, NULL);
+    // Appends wait for durability with a timeout on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&store->durable_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    rc = pthread_create(&store->flusher, NULL, segstore_flusher, store);
+    if (rc != 0) {
+        pthread_cond_destroy(&store->durable_cond);
+        pthread_cond_destroy(&store->flush_cond);
+        pthread_mutex_destroy(&store->lock);
+        errno = rc;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    rc = errno;
+    for (size_t i = 0; i < store->nr_segs; i++) {
+        segment_put(segstore_seg(store, i));
+    }
+    store->nr_segs = 0;
+    close(store->dir_fd);
+    store->dir_fd = -1;
+    errno = rc;
+    return -1;
+}
+
+int segstore_appendv(struct segstore *store, const struct iovec *iov, int iovcnt, size_t len, off_t *end_rtn) {
+    struct segment *seg;
+    struct timespec deadline;
+    off_t end;
+    int saved_errno;
+
+    if (len > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (len == 0) {
+        // An empty record would look torn to recovery
+        if (end_rtn) *end_rtn = segstore_length(store);
+        return 0;
+    }
+
+    pthread_mutex_lock(&store->lock);
+    seg = store->nr_segs ? segstore_seg(store, store->nr_segs - 1) : NULL;
+    if (!seg || seg->size - seg->used < len) {
+        seg = segstore_roll(store, len);
+    }
+    if (!seg || segment_index_record(seg, seg->used + len) == -1) {
+        saved_errno = errno;
+        pthread_mutex_unlock(&store->lock);
+        errno = saved_errno;
+        return -1;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(seg->map + seg->used, iov[i].iov_base, iov[i].iov_len);
+        seg->used += iov[i].iov_len;
+    }
+    store->length += len;
+    store->nr_retained++;
+    end = store->length;
+    segstore_trim(store);
+
+    pthread_cond_signal(&store->flush_cond);
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += (long)(SEGSTORE_DURABLE_TIMEOUT_MS % 1000) * 1000000;
+    deadline.tv_sec += SEGSTORE_DURABLE_TIMEOUT_MS / 1000 + deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    while (atomic_load_explicit(&store->durable, memory_order_relaxed) < end) {
+        if (pthread_cond_timedwait(&store->durable_cond, &store->lock, &deadline) == ETIMEDOUT &&
+            atomic_load_explicit(&store->durable, memory_order_relaxed) < end) {
+            pthread_mutex_unlock(&store->lock);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    if (end_rtn) {
+        *end_rtn = end;
+    }
+    return 0;
+}
+
+int segstore_reply(struct segstore *store, off_t end, const struct reply_ops *reply, void *ctx) {
+    struct segment *seg = NULL;
+    size_t nr = 0;
+    off_t pos;
+    int retval = 0;
+
+    // Take a reference to every segment in range, retention may retire
+    // them while they are sent
+    pthread_mutex_lock(&store->lock);
+    pos = store->start;
+    if (end <= pos) {
+        // Newer appends pushed this record out already, reply with those
+        // that are durable
+        end = atomic_load(&store->durable);
+    }
+    for (size_t i = 0; i < store->nr_segs; i++) {
+        struct segment *s = segstore_seg(store, i);
+        if (s->base >= end) break;
+        if (!seg && s->base + (off_t)s->used <= pos) continue;
+        if (!seg) seg = s;
+        atomic_fetch_add(&s->refs, 1);
+        nr++;
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    while (nr-- > 0) {
+        struct segment *next = nr ? seg->next : NULL;
+        // A segment ends where the next one starts, its unused tail is skipped
+        off_t seg_end = next ? next->base : end;
+        off_t from = pos > seg->base ? pos : seg->base;
+        if (seg_end > end) seg_end = end;
+        if (retval == 0 && seg_end > from) {
+            retval = reply->mapped(ctx, seg, from - seg->base, seg_end - from);
+        } else {
+            segment_put(seg);
+        }
+        seg = next;
+    }
+    return retval;
+}
+
+void segstore_close(struct segstore *store) {
+    if (store->dir_fd == -1) {
+        return;
+    }
+    pthread_mutex_lock(&store->lock);
+    store->stopping = true;
+    pthread_cond_signal(&store->flush_cond);
+    pthread_mutex_unlock(&store->lock);
+    pthread_join(store->flusher, NULL);
+
+    for (size_t i = 0; i < store->nr_segs; i++) {
+        segment_put(segstore_seg(store, i));
+    }
+    store->nr_segs = 0;
+    close(store->dir_fd);
+    store->dir_fd = -1;
+    pthread_cond_destroy(&store->durable_cond);
+    pthread_cond_destroy(&store->flush_cond);
+    pthread_mutex_destroy(&store->lock);
+}
@@ -0,0 +1,179 @@
+/*
+ * segstore.h
+ *
+ * Persistent alternative to store.h, selected with -b segment. Records are
+ * appended to fixed size segment files mapped into memory, so replies are
+ * sent straight from the mapping. Next to each segment an index file holds
+ * the end offset of every record in it.
+ *
+ * A flusher thread group commits: at most once per sync interval it
+ * fdatasync()s the segments written since the last round, then appends
+ * their index entries and syncs the index files. An append returns once its
+ * record is durable, and replies never go past the durable length, so
+ * whatever a client was sent survives a crash. Recovery on restart reads
+ * only the index files: a record is there once both it and its index entry
+ * reached the disk, anything after the last index entry is overwritten.
+ *
+ * Retention mirrors aesd_circular_buffer: with a limit on records or bytes
+ * set, the oldest records drop out of replies as new ones come in, and a
+ * segment whose records all dropped out is deleted whole. Nothing is ever
+ * rewritten, so the cost of a reply stays bounded however long the server
+ * runs.
+ */
+
+#ifndef AESDSOCKET_SEGSTORE_H
+#define AESDSOCKET_SEGSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct reply_ops;
+
+#define SEGSTORE_DIR "/var/tmp/aesdsocketdata.d"
+/**
+ * Size of a segment file, a longer record gets a segment of its own size
+ */
+#define SEGSTORE_SEGMENT_SIZE (4 * 1024 * 1024)
+#define SEGSTORE_MAX_SEGMENTS 4096
+/**
+ * Default for -i, the shortest time between two group commits
+ */
+#define SEGSTORE_SYNC_INTERVAL_MS 5
+/**
+ * Longest an append waits for its group commit, see segstore_appendv()
+ */
+#define SEGSTORE_DURABLE_TIMEOUT_MS 1000
+
+struct segment {
+    unsigned int id;  // NNNNNNNN.seg and NNNNNNNN.idx in the store directory
+    /**
+     * The store holds one reference while the segment is retained, each
+     * reply range and group commit in flight holds another
+     */
+    _Atomic int refs;
+    int fd;
+    int index_fd;
+    char *map;
+    size_t size;
+    /**
+     * Stream offset of the first byte of the segment
+     */
+    off_t base;
+    /**
+     * Bytes appended so far, the rest of the mapping is unused
+     */
+    size_t used;
+    /**
+     * End offset within the segment of every record, nr_synced of them are
+     * in the index file
+     */
+    uint32_t *ends;
+    size_t nr_records;
+    size_t records_cap;
+    size_t nr_synced;
+    /**
+     * The segment rolled to after this one, set under the store lock
+     */
+    struct segment *next;
+};
+
+struct segstore {
+    int dir_fd;
+    /**
+     * Protects everything below but the atomics
+     */
+    pthread_mutex_t lock;
+    /**
+     * Signalled by appenders for the flusher, and by the flusher when
+     * durable advances
+     */
+    pthread_cond_t flush_cond;
+    pthread_cond_t durable_cond;
+    pthread_t flusher;
+    bool stopping;
+    bool dir_dirty;  // a segment was created since the directory was synced
+    unsigned int sync_interval_ms;
+    /**
+     * Retention limits, 0 for none
+     */
+    off_t max_bytes;
+    size_t max_records;
+    /**
+     * Retained segments in stream order, a ring starting at seg_head
+     */
+    struct segment *segs[SEGSTORE_MAX_SEGMENTS];
+    size_t seg_head;
+    size_t nr_segs;
+    /**
+     * First segment with records the index files don't have yet
+     */
+    unsigned int sync_id;
+    /**
+     * Records of the first segment that dropped out, and records retained
+     */
+    size_t trimmed;
+    size_t nr_retained;
+    /**
+     * Stream offset of the oldest retained record, where replies start
+     */
+    off_t start;
+    /**
+     * Bytes appended, and bytes known to be on disk
+     */
+    off_t length;
+    _Atomic off_t durable;
+};
+
+/**
+ * Open the store kept in directory @param dir, creating it if needed, and
+ * recover the records already there from the index files. Group commits run
+ * at most every @param sync_interval_ms. Only the newest @param max_records
+ * records, or the newest records within @param max_bytes, are retained; 0
+ * means no limit. The newest record is always retained.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int segstore_open(struct segstore *store, const char *dir, unsigned int sync_interval_ms,
+                  off_t max_bytes, size_t max_records);
+
+/**
+ * Append one record of @param len bytes gathered from @param iov and wait
+ * until it is durable. Records are ordered as appends take the store lock.
+ * The wait is the rest of the sync interval plus an fdatasync() and blocks
+ * the calling thread, an event loop worker included; after
+ * SEGSTORE_DURABLE_TIMEOUT_MS it gives up with ETIMEDOUT. The record stays
+ * appended and goes to disk with a later group commit, only the caller's
+ * reply to it is dropped.
+ * @param end_rtn if not NULL, receives the stream offset right after it
+ * @return 0 on success, -1 with errno set on failure
+ */
+int segstore_appendv(struct segstore *store, const struct iovec *iov, int iovcnt, size_t len, off_t *end_rtn);
+
+/**
+ * Pass the retained stream up to @param end, which must not be past the
+ * durable length, to @param reply as one range of mapped memory per segment
+ */
+int segstore_reply(struct segstore *store, off_t end, const struct reply_ops *reply, void *ctx);
+
+/**
+ * Drop a reference to @param seg taken for a reply, see reply_ops
+ */
+void segment_put(struct segment *seg);
+
+/**
+ * @return the durable length of the store
+ */
+static inline off_t segstore_length(struct segstore *store) {
+    return atomic_load_explicit(&store->durable, memory_order_acquire);
+}
+
+/**
+ * Commit whatever is pending, then unmap and close everything
+ */
+void segstore_close(struct segstore *store);
+
+#endif /* AESDSOCKET_SEGSTORE_H */
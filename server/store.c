@@ -0,0 +1,199 @@
+/*
+ * store.c
+ *
+ * Append-only DATA_FILE with a cached committed length, see store.h
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "store.h"
+#include "rxbuf.h"
+
+/**
+ * Buffers a group commit gathers without allocating
+ */
+#define STORE_BATCH_IOV 64
+
+int store_open(struct store *store, const char *path) {
+    struct stat st;
+
+    memset(store, 0, sizeof(struct store));
+    // No O_APPEND: writers pwrite() at the offset they reserved
+    store->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (store->fd == -1) {
+        return -1;
+    }
+    if (fstat(store->fd, &st) == -1) {
+        close(store->fd);
+        store->fd = -1;
+        return -1;
+    }
+    store->reserved = st.st_size;
+    atomic_init(&store->length, st.st_size);
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_cond_init(&store->commit_cond, NULL);
+    pthread_mutex_init(&store->queue_lock, NULL);
+    pthread_cond_init(&store->queue_cond, NULL);
+    store->queue_tail = &store->queue_head;
+    return 0;
+}
+
+void store_reserve(struct store *store, size_t len, uint64_t *seq_rtn, off_t *offset_rtn) {
+    pthread_mutex_lock(&store->lock);
+    *seq_rtn = store->next_seq++;
+    *offset_rtn = store->reserved;
+    store->reserved += len;
+    pthread_mutex_unlock(&store->lock);
+}
+
+off_t store_wait_turn(struct store *store, uint64_t seq) {
+    off_t start;
+
+    pthread_mutex_lock(&store->lock);
+    while (store->commit_seq != seq) {
+        pthread_cond_wait(&store->commit_cond, &store->lock);
+    }
+    start = atomic_load_explicit(&store->length, memory_order_relaxed);
+    pthread_mutex_unlock(&store->lock);
+    return start;
+}
+
+void store_commit(struct store *store, uint64_t seq, off_t end) {
+    pthread_mutex_lock(&store->lock);
+    while (store->commit_seq != seq) {
+        pthread_cond_wait(&store->commit_cond, &store->lock);
+    }
+    // A failed record still has to commit so later sequence numbers can. If
+    // it was cut short and is the last one reserved, its unwritten tail is
+    // handed back to the next reservation; until then later records move
+    // down to the committed length when their turn comes.
+    if (store->next_seq == seq + 1) {
+        store->reserved = end;
+    }
+    atomic_store_explicit(&store->length, end, memory_order_release);
+    store->commit_seq++;
+    pthread_cond_broadcast(&store->commit_cond);
+    pthread_mutex_unlock(&store->lock);
+}
+
+/**
+ * Write the appends of @param batch back to back from @param offset, with
+ * one vectored write of @param iov or, if gathering their buffers failed,
+ * one write each. An append gets the errno of a failed write unless all of
+ * its bytes landed ahead of the failure, and so does every later one.
+ */
+static void store_write_reqs(struct store *store, struct store_req *batch,
+                             const struct iovec *iov, int iovcnt, off_t offset) {
+    struct store_req *req;
+    size_t written = 0;
+    size_t pos = 0;
+    int error = 0;
+
+    if (iov && iov_write_all(store->fd, iov, iovcnt, offset, &written) == -1) {
+        error = errno;
+    }
+    for (req = batch; req; req = req->next) {
+        if (!iov && !error &&
+            iov_write_all(store->fd, req->iov, req->iovcnt, offset + pos, NULL) == -1) {
+            error = errno;
+        }
+        pos += req->len;
+        req->error = error && (!iov || pos > written) ? error : 0;
+    }
+}
+
+/**
+ * Write the queued appends of @param batch back to back with one reservation
+ * and, unless gathering their buffers fails, one vectored write. The batch
+ * commits through its last append written in full.
+ */
+static void store_write_batch(struct store *store, struct store_req *batch) {
+    struct iovec stack_iov[STORE_BATCH_IOV];
+    struct iovec *iov = stack_iov;
+    struct store_req *req;
+    size_t total = 0;
+    int iovcnt = 0;
+    uint64_t seq;
+    off_t offset, start, end;
+
+    for (req = batch; req; req = req->next) {
+        total += req->len;
+        iovcnt += req->iovcnt;
+    }
+    if (iovcnt > STORE_BATCH_IOV) {
+        iov = malloc(iovcnt * sizeof(struct iovec));
+    }
+    iovcnt = 0;
+    for (req = batch; iov && req; req = req->next) {
+        memcpy(iov + iovcnt, req->iov, req->iovcnt * sizeof(struct iovec));
+        iovcnt += req->iovcnt;
+    }
+
+    store_reserve(store, total, &seq, &offset);
+    store_write_reqs(store, batch, iov, iovcnt, offset);
+    start = store_wait_turn(store, seq);
+    if (start != offset) {
+        // An earlier record was cut short, close the gap it left
+        store_write_reqs(store, batch, iov, iovcnt, start);
+    }
+
+    end = start;
+    for (req = batch; req; req = req->next) {
+        if (!req->error) end += req->len;
+        req->end = end;
+    }
+    store_commit(store, seq, end);
+    if (iov != stack_iov) {
+        free(iov);
+    }
+}
+
+int store_appendv(struct store *store, const struct iovec *iov, int iovcnt, size_t len, off_t *end_rtn) {
+    struct store_req req = { .iov = iov, .iovcnt = iovcnt, .len = len };
+
+    pthread_mutex_lock(&store->queue_lock);
+    *store->queue_tail = &req;
+    store->queue_tail = &req.next;
+    while (!req.done && store->leader_active) {
+        pthread_cond_wait(&store->queue_cond, &store->queue_lock);
+    }
+    if (!req.done) {
+        // Lead: take the whole queue, appends queued meanwhile form the next batch
+        struct store_req *batch = store->queue_head;
+        store->queue_head = NULL;
+        store->queue_tail = &store->queue_head;
+        store->leader_active = true;
+        pthread_mutex_unlock(&store->queue_lock);
+
+        store_write_batch(store, batch);
+
+        pthread_mutex_lock(&store->queue_lock);
+        for (struct store_req *r = batch; r; r = r->next) {
+            r->done = true;
+        }
+        store->leader_active = false;
+        pthread_cond_broadcast(&store->queue_cond);
+    }
+    pthread_mutex_unlock(&store->queue_lock);
+
+    if (end_rtn) {
+        *end_rtn = req.end;
+    }
+    errno = req.error;
+    return req.error ? -1 : 0;
+}
+
+void store_close(struct store *store) {
+    if (store->fd != -1) {
+        close(store->fd);
+        store->fd = -1;
+        pthread_cond_destroy(&store->commit_cond);
+        pthread_mutex_destroy(&store->lock);
+        pthread_cond_destroy(&store->queue_cond);
+        pthread_mutex_destroy(&store->queue_lock);
+    }
+}
@@ -0,0 +1,130 @@
+/*
+ * store.h
+ *
+ * Append-only view of DATA_FILE used when the server runs without the
+ * aesdchar device. The file stays open for the lifetime of the server and
+ * its committed length is cached, so replies can be streamed with sendfile()
+ * without reopening, re-reading or even stat()ing it.
+ *
+ * Appends form a sequenced log: a writer reserves its offset and sequence
+ * number in a short critical section, writes its bytes with pwrite() outside
+ * of it and then commits in sequence order. A record that failed commits
+ * only the bytes it wrote, and records after it are written again at the
+ * committed length when their turn comes, so the committed range never
+ * holds a hole. Readers only need the committed length, which they load
+ * without taking any lock.
+ *
+ * store_appendv() callers group commit: appends queue up, the first one
+ * waiting becomes the leader and writes the whole queue as one record range
+ * with a single pwritev(), while the others wait for it to hand them their
+ * end offsets. Records keep the order in which they were queued.
+ */
+
+#ifndef AESDSOCKET_STORE_H
+#define AESDSOCKET_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * One store_appendv() call waiting in the group commit queue
+ */
+struct store_req {
+    const struct iovec *iov;
+    int iovcnt;
+    size_t len;
+    off_t end;
+    int error;  // errno of a failed write, 0 on success
+    bool done;
+    struct store_req *next;
+};
+
+struct store {
+    /**
+     * DATA_FILE, written with pwrite() and used as the sendfile() source
+     */
+    int fd;
+    /**
+     * Protects the reservation state below
+     */
+    pthread_mutex_t lock;
+    /**
+     * Signalled whenever commit_seq advances
+     */
+    pthread_cond_t commit_cond;
+    /**
+     * Sequence number handed to the next reservation
+     */
+    uint64_t next_seq;
+    /**
+     * Sequence number of the next record allowed to commit
+     */
+    uint64_t commit_seq;
+    /**
+     * End offset of the last reserved record
+     */
+    off_t reserved;
+    /**
+     * Committed length of the file: every byte below it has been written
+     */
+    _Atomic off_t length;
+    /**
+     * Group commit queue, protects the fields below
+     */
+    pthread_mutex_t queue_lock;
+    /**
+     * Signalled when a leader is done with its batch
+     */
+    pthread_cond_t queue_cond;
+    struct store_req *queue_head;
+    struct store_req **queue_tail;
+    bool leader_active;
+};
+
+/**
+ * Open (creating if needed) @param path as the backing file of @param store.
+ * Data already in the file counts as committed.
+ * @return 0 on success, -1 with errno set on failure
+ */
+int store_open(struct store *store, const char *path);
+
+/**
+ * Append @param len bytes gathered from @param iovcnt buffers as one record.
+ * Safe to call concurrently; concurrent calls are group committed and
+ * records commit in the order their offsets were reserved.
+ * @param end_rtn if not NULL, receives the end offset of this record, i.e.
+ * the committed length right after it was committed
+ * @return 0 on success, -1 with errno set on failure
+ */
+int store_appendv(struct store *store, const struct iovec *iov, int iovcnt, size_t len, off_t *end_rtn);
+
+/**
+ * The three steps of an append, for callers that issue the write
+ * themselves (see uring.c). store_reserve() hands out the offset and
+ * sequence number of a @param len byte record. store_wait_turn() returns
+ * once every earlier record has committed, with the committed length: the
+ * record's offset unless an earlier one was cut short, in which case the
+ * record must be written there instead. store_commit() publishes the
+ * record after its bytes are written, waiting for its turn if needed; a
+ * record that was only partly written commits with @param end just past
+ * its written bytes.
+ */
+void store_reserve(struct store *store, size_t len, uint64_t *seq_rtn, off_t *offset_rtn);
+off_t store_wait_turn(struct store *store, uint64_t seq);
+void store_commit(struct store *store, uint64_t seq, off_t end);
+
+/**
+ * @return the committed length of the store
+ */
+static inline off_t store_length(struct store *store) {
+    return atomic_load_explicit(&store->length, memory_order_acquire);
+}
+
+void store_close(struct store *store);
+
+#endif /* AESDSOCKET_STORE_H */
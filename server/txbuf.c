@@ -0,0 +1,147 @@
+/*
+ * txbuf.c
+ *
+ * Queued replies for non-blocking client sockets, see txbuf.h
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include "aesdsocket.h"
+#include "segstore.h"
+#include "txbuf.h"
+
+void tx_queue_init(struct tx_queue *queue, int fd) {
+    memset(queue, 0, sizeof(*queue));
+    queue->fd = fd;
+}
+
+static struct tx_seg *tx_push_seg(struct tx_queue *queue, int file_fd, off_t off, off_t end) {
+    if (queue->nr_segs == queue->segs_cap) {
+        size_t new_cap = queue->segs_cap ? queue->segs_cap * 2 : 4;
+        struct tx_seg *new_segs = realloc(queue->segs, new_cap * sizeof(struct tx_seg));
+        if (!new_segs) {
+            perror("realloc");
+            return NULL;
+        }
+        queue->segs = new_segs;
+        queue->segs_cap = new_cap;
+    }
+    struct tx_seg *seg = &queue->segs[queue->nr_segs++];
+    seg->file_fd = file_fd;
+    seg->mapped = NULL;
+    seg->off = off;
+    seg->end = end;
+    return seg;
+}
+
+static int tx_queue_data(void *ctx, const char *buf, size_t len) {
+    struct tx_queue *queue = ctx;
+    if (queue->len + len > queue->cap) {
+        size_t new_cap = queue->cap ? queue->cap : BUFFER_SIZE;
+        while (new_cap < queue->len + len) new_cap *= 2;
+        char *new_buf = realloc(queue->buf, new_cap);
+        if (!new_buf) {
+            perror("realloc");
+            return -1;
+        }
+        queue->buf = new_buf;
+        queue->cap = new_cap;
+    }
+    memcpy(queue->buf + queue->len, buf, len);
+
+    struct tx_seg *last = queue->nr_segs ? &queue->segs[queue->nr_segs - 1] : NULL;
+    if (last && last->file_fd == -1 && !last->mapped) {
+        last->end += len;
+    } else if (!tx_push_seg(queue, -1, queue->len, queue->len + len)) {
+        return -1;
+    }
+    queue->len += len;
+    return 0;
+}
+
+static int tx_queue_file(void *ctx, int fd, off_t offset, size_t len) {
+    return tx_push_seg(ctx, fd, offset, offset + len) ? 0 : -1;
+}
+
+static int tx_queue_mapped(void *ctx, struct segment *mapped, size_t offset, size_t len) {
+    struct tx_seg *seg = tx_push_seg(ctx, -1, offset, offset + len);
+    if (!seg) {
+        segment_put(mapped);
+        return -1;
+    }
+    seg->mapped = mapped;
+    return 0;
+}
+
+static ssize_t tx_queue_device(void *ctx, int fd, off_t offset, size_t len) {
+    struct tx_queue *queue = ctx;
+    off_t start = offset;
+
+    // Earlier output goes first, the caller queues the whole range instead
+    if (tx_queue_pending(queue)) {
+        return 0;
+    }
+    while ((size_t)(offset - start) < len) {
+        ssize_t sent = sendfile(queue->fd, fd, &offset, len - (offset - start));
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (offset == start) return -1;
+            break;
+        }
+        if (sent == 0) break;
+    }
+    return offset - start;
+}
+
+const struct reply_ops tx_queue_reply = {
+    .data = tx_queue_data,
+    .file = tx_queue_file,
+    .mapped = tx_queue_mapped,
+    .device = tx_queue_device,
+};
+
+int tx_queue_flush(struct tx_queue *queue) {
+    while (queue->seg_head < queue->nr_segs) {
+        struct tx_seg *seg = &queue->segs[queue->seg_head];
+        while (seg->off < seg->end) {
+            ssize_t sent;
+            if (seg->file_fd == -1) {
+                const char *base = seg->mapped ? seg->mapped->map : queue->buf;
+                sent = send(queue->fd, base + seg->off, seg->end - seg->off, MSG_NOSIGNAL);
+                if (sent > 0) seg->off += sent;
+            } else {
+                sent = sendfile(queue->fd, seg->file_fd, &seg->off, seg->end - seg->off);
+            }
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                return -1;
+            }
+            if (sent == 0) break;
+        }
+        if (seg->mapped) {
+            segment_put(seg->mapped);
+            seg->mapped = NULL;
+        }
+        queue->seg_head++;
+    }
+    queue->len = 0;
+    queue->nr_segs = 0;
+    queue->seg_head = 0;
+    return 1;
+}
+
+void tx_queue_destroy(struct tx_queue *queue) {
+    for (size_t i = queue->seg_head; i < queue->nr_segs; i++) {
+        if (queue->segs[i].mapped) segment_put(queue->segs[i].mapped);
+    }
+    free(queue->buf);
+    free(queue->segs);
+    tx_queue_init(queue, -1);
+}
@@ -0,0 +1,71 @@
+/*
+ * txbuf.h
+ *
+ * Send side of a non-blocking client socket. Replies are queued as they are
+ * produced, as copies, ranges of the data file or referenced ranges of a
+ * segment store mapping, and flushed for as long as the socket takes them.
+ * A worker never waits for a slow client: it stops reading from it until
+ * the socket is writable again and the queue drained.
+ */
+
+#ifndef AESDSOCKET_TXBUF_H
+#define AESDSOCKET_TXBUF_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct reply_ops;
+struct segment;
+
+/**
+ * Piece of the pending output: a range of the queue's buffer, of a file
+ * when file_fd is set or of a segment store mapping when mapped is, holding
+ * a reference to it. Replies to pipelined packets queue up in arrival order.
+ */
+struct tx_seg {
+    int file_fd;  // -1 for the queue's buffer
+    struct segment *mapped;
+    off_t off;
+    off_t end;
+};
+
+struct tx_queue {
+    int fd;  // the non-blocking socket flushed to
+    char *buf;
+    size_t len;
+    size_t cap;
+    struct tx_seg *segs;
+    size_t nr_segs;
+    size_t segs_cap;
+    size_t seg_head;  // first segment not fully sent
+};
+
+/**
+ * Reply sink queueing on the struct tx_queue passed as ctx. Its device hook
+ * sends straight from the device while nothing else is queued, as much as
+ * the socket takes without waiting.
+ */
+extern const struct reply_ops tx_queue_reply;
+
+void tx_queue_init(struct tx_queue *queue, int fd);
+
+/**
+ * Send as much of the pending output as the socket accepts.
+ * @return 1 when all of it is sent, 0 if the socket is full, -1 on error
+ */
+int tx_queue_flush(struct tx_queue *queue);
+
+/**
+ * Drop whatever is still queued along with the references it holds
+ */
+void tx_queue_destroy(struct tx_queue *queue);
+
+/**
+ * @return true while part of a reply waits for the socket
+ */
+static inline bool tx_queue_pending(const struct tx_queue *queue) {
+    return queue->seg_head < queue->nr_segs;
+}
+
+#endif /* AESDSOCKET_TXBUF_H */
@@ -0,0 +1,427 @@
+/*
+ * uring.c
+ *
+ * io_uring client path, see uring.h. Each client owns a small ring with
+ * DATA_FILE and the client socket registered as fixed files and a
+ * registered receive buffer. A packet costs one submission for its receive
+ * and one for its append. The socket is non-blocking like every pool
+ * client's: replies are queued on the connection's tx_queue and flushed by
+ * the pool task, so a slow client never holds up its worker or its shard.
+ */
+
+#include "uring.h"
+
+#if USE_IO_URING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "aesdsocket.h"
+#include "rxbuf.h"
+#include "txbuf.h"
+#include "framing.h"
+
+#define URING_ENTRIES 8
+// Linux UIO_MAXIOV, the most buffers one IORING_OP_WRITEV accepts
+#define URING_MAX_IOV 1024
+
+// Indexes into the registered file and buffer tables
+enum { URING_FILE_DATA, URING_FILE_CLIENT };
+enum { URING_BUF_RECV };
+
+// user_data of each request kind, at most one of each is in flight
+enum { URING_TAG_RECV, URING_TAG_WRITE, URING_NR_TAGS };
+
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    unsigned to_submit;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+struct uring_client {
+    struct uring ring;
+    int client_fd;
+    int shard;
+    int data_fd;
+    char *recv_buf;
+    struct tx_queue *out;  // where replies are queued
+    int results[URING_NR_TAGS];
+};
+
+static int uring_setup(struct uring *ring, unsigned entries) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(struct uring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        goto fail_close;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            goto fail_sq;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto fail_cq;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + params.cq_off.cqes);
+    return 0;
+
+fail_cq:
+    if (ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+fail_sq:
+    munmap(ring->sq_ptr, ring->sq_size);
+fail_close:
+    close(ring->fd);
+    ring->fd = -1;
+    return -1;
+}
+
+static void uring_teardown(struct uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/**
+ * @return the request queued last, to set fields uring_prep_rw() leaves at 0
+ */
+static struct io_uring_sqe *uring_last_sqe(struct uring *ring) {
+    return &ring->sqes[(ring->sqe_tail - 1) & *ring->sq_mask];
+}
+
+static int uring_register(struct uring *ring, unsigned opcode, const void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, ring->fd, opcode, arg, nr_args);
+}
+
+/**
+ * Queue a read or write style request. Buffers with @param buf_index >= 0
+ * come from the registered table, @param fixed_file indexes the file table.
+ */
+static void uring_prep_rw(struct uring *ring, uint8_t opcode, int fixed_file, const void *addr,
+                          unsigned len, off_t offset, int buf_index, uint8_t flags, uint64_t tag) {
+    // Callers never queue more than URING_ENTRIES requests before submitting
+    unsigned index = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->flags = flags | IOSQE_FIXED_FILE;
+    sqe->fd = fixed_file;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    if (buf_index >= 0) sqe->buf_index = buf_index;
+    sqe->user_data = tag;
+
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    ring->to_submit++;
+}
+
+/**
+ * Submit the queued requests and wait until all of them completed, storing
+ * each result in @param results indexed by its tag.
+ */
+static int uring_run(struct uring *ring, int *results) {
+    unsigned pending = ring->to_submit;
+    unsigned submit = ring->to_submit;
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    ring->to_submit = 0;
+
+    while (pending > 0) {
+        int rc = syscall(__NR_io_uring_enter, ring->fd, submit, pending, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        submit = 0;
+
+        unsigned head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data < URING_NR_TAGS) {
+                results[cqe->user_data] = cqe->res;
+            }
+            head++;
+            pending--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+static void uring_client_cleanup(struct uring_client *uc) {
+    uring_teardown(&uc->ring);
+    free(uc->recv_buf);
+#if USE_AESD_CHAR_DEVICE
+    if (uc->data_fd != -1) close(uc->data_fd);
+#endif
+}
+
+static int uring_client_init(struct uring_client *uc, int client_fd, int shard, struct tx_queue *out) {
+    memset(uc, 0, sizeof(struct uring_client));
+    uc->client_fd = client_fd;
+    uc->shard = shard;
+    uc->data_fd = -1;
+    uc->out = out;
+
+    // The ring only appends to DATA_FILE or the device
+#if USE_AESD_CHAR_DEVICE
+    if (data_backend != BACKEND_DEVICE) {
+#else
+    if (data_backend != BACKEND_FILE) {
+#endif
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (uring_setup(&uc->ring, URING_ENTRIES) == -1) {
+        return -1;
+    }
+
+#if USE_AESD_CHAR_DEVICE
+    // The reply streams up to the end, it must not block there even if the
+    // driver was loaded with follow=1
+    uc->data_fd = open(shards[shard].path, O_RDWR | O_CLOEXEC | O_NONBLOCK);
+#else
+    uc->data_fd = data_store.fd;
+#endif
+    if (uc->data_fd == -1 ||
+        posix_memalign((void **)&uc->recv_buf, 4096, BUFFER_SIZE) != 0) {
+        goto fail;
+    }
+
+    struct iovec iov[1] = {
+        [URING_BUF_RECV] = { .iov_base = uc->recv_buf, .iov_len = BUFFER_SIZE },
+    };
+    int files[2] = {
+        [URING_FILE_DATA] = uc->data_fd,
+        [URING_FILE_CLIENT] = client_fd,
+    };
+    if (uring_register(&uc->ring, IORING_REGISTER_BUFFERS, iov, 1) == -1 ||
+        uring_register(&uc->ring, IORING_REGISTER_FILES, files, 2) == -1) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    uring_client_cleanup(uc);
+    return -1;
+}
+
+/**
+ * Queue the append of @param iov at @param offset as a vectored write.
+ * Batches with more chunks than one request can take are written
+ * synchronously instead, and so are batches of several lines for the char
+ * device, which needs one write per line.
+ * @param written_rtn receives the bytes a synchronous write got to the file
+ * @return 1 if the write was queued and its result must be checked, 0 if it
+ * was written and -1 if writing it failed
+ */
+static int uring_prep_append(struct uring_client *uc, const struct iovec *iov, int iovcnt,
+                             int nr_lines, size_t len, off_t offset, size_t *written_rtn) {
+    int rc;
+
+    *written_rtn = 0;
+    if (USE_AESD_CHAR_DEVICE && nr_lines > 1) {
+        rc = iov_write_lines(uc->data_fd, iov, iovcnt);
+        if (rc == 0) *written_rtn = len;
+    } else if (iovcnt > URING_MAX_IOV) {
+        rc = iov_write_all(uc->data_fd, iov, iovcnt, offset, written_rtn);
+    } else {
+        uring_prep_rw(&uc->ring, IORING_OP_WRITEV, URING_FILE_DATA, (void *)iov, iovcnt,
+                      offset, -1, 0, URING_TAG_WRITE);
+        return 1;
+    }
+    if (rc == -1) {
+        syslog(LOG_ERR, "append to %s failed: %s", DATA_FILE, strerror(errno));
+    }
+    return rc;
+}
+
+/**
+ * Issue the append prepared by uring_prep_append() and wait for it.
+ * @return how many of its @param len bytes were written, a failed or short
+ * write is logged
+ */
+static size_t uring_run_append(struct uring_client *uc, size_t len) {
+    if (uring_run(&uc->ring, uc->results) == -1) {
+        syslog(LOG_ERR, "io_uring_enter: %s", strerror(errno));
+        return 0;
+    }
+    int res = uc->results[URING_TAG_WRITE];
+    if (res < 0 || (size_t)res != len) {
+        syslog(LOG_ERR, "append to %s failed: %d", DATA_FILE, res);
+    }
+    return res < 0 ? 0 : res;
+}
+
+/**
+ * Append a batch of @param nr_lines data lines with the ring and queue the
+ * reply. A failed or short append gets no reply, the client sees the
+ * connection carry on without its echo, as in process_packet().
+ */
+static void uring_append_and_reply(struct uring_client *uc, const struct iovec *iov, int iovcnt,
+                                   size_t len, int nr_lines) {
+    size_t written;
+
+#if USE_AESD_CHAR_DEVICE
+    pthread_mutex_lock(&shards[uc->shard].lock);
+    if (uring_prep_append(uc, iov, iovcnt, nr_lines, len, 0, &written) == 1) {
+        written = uring_run_append(uc, len);
+    }
+    // The socket doesn't block, the device is queued or sent under the lock
+    if (written == len && lseek(uc->data_fd, 0, SEEK_SET) == 0) {
+        reply_rest(uc->data_fd, &tx_queue_reply, uc->out);
+    }
+    pthread_mutex_unlock(&shards[uc->shard].lock);
+#else
+    uint64_t seq;
+    off_t offset;
+    store_reserve(&data_store, len, &seq, &offset);
+    // Written at the committed length once every earlier record is, so a
+    // short write leaves no hole for later records to commit over
+    offset = store_wait_turn(&data_store, seq);
+    if (uring_prep_append(uc, iov, iovcnt, nr_lines, len, offset, &written) == 1) {
+        written = uring_run_append(uc, len);
+    }
+    store_commit(&data_store, seq, offset + written);
+    if (written == len) {
+        tx_queue_reply.file(uc->out, data_store.fd, 0, offset + len);
+    }
+#endif
+}
+
+static int uring_handle_lines(const struct iovec *iov, int iovcnt, size_t len, int nr_lines, void *ctx) {
+    struct uring_client *uc = ctx;
+    struct aesd_seekto seekto;
+    struct aesd_readv_desc descs[AESDCHAR_READV_MAX];
+
+    if (parse_seekto(iov, iovcnt, len, &seekto) || parse_readv(iov, iovcnt, len, descs) > 0) {
+        process_packet(iov, iovcnt, len, uc->shard, &tx_queue_reply, uc->out);
+    } else {
+        uring_append_and_reply(uc, iov, iovcnt, len, nr_lines);
+    }
+    return 0;
+}
+
+struct uring_client *uring_client_new(int client_fd, int shard, struct tx_queue *out) {
+    static _Atomic bool fallback_logged;
+    struct uring_client *uc = malloc(sizeof(struct uring_client));
+
+    if (!uc || uring_client_init(uc, client_fd, shard, out) == -1) {
+        if (!atomic_exchange(&fallback_logged, true)) {
+            syslog(LOG_WARNING, "io_uring unavailable (%s), using recv()", strerror(errno));
+        }
+        free(uc);
+        return NULL;
+    }
+    return uc;
+}
+
+ssize_t uring_client_recv(struct uring_client *uc, struct rx_packet *packet, struct rx_pool *pool) {
+    int bytes_received;
+
+    do {
+        uring_prep_rw(&uc->ring, IORING_OP_READ_FIXED, URING_FILE_CLIENT, uc->recv_buf, BUFFER_SIZE,
+                      0, URING_BUF_RECV, 0, URING_TAG_RECV);
+        // Fail with -EAGAIN once the socket is drained instead of waiting
+        uring_last_sqe(&uc->ring)->rw_flags = RWF_NOWAIT;
+        if (uring_run(&uc->ring, uc->results) == -1) {
+            perror("io_uring_enter");
+            return 0;
+        }
+        bytes_received = uc->results[URING_TAG_RECV];
+    } while (bytes_received == -EINTR);
+
+    if (bytes_received == -EAGAIN) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (bytes_received < 0) {
+        if (keep_running) syslog(LOG_ERR, "recv: %s", strerror(-bytes_received));
+        return 0;
+    }
+    if (bytes_received == 0) {
+        return 0; // Connection closed
+    }
+
+    // The registered buffer is reused by the next receive, so chain a copy
+    if (rx_packet_append(packet, pool, uc->recv_buf, bytes_received) == -1) {
+        perror("rx_packet_append");
+        return 0;
+    }
+    if (frame_packet(packet, pool, bytes_received, uring_handle_lines, uc) == -1) {
+        return 0;
+    }
+    return bytes_received;
+}
+
+void uring_client_free(struct uring_client *uc) {
+    uring_client_cleanup(uc);
+    free(uc);
+}
+
+#endif /* USE_IO_URING */
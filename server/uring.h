@@ -0,0 +1,47 @@
+/*
+ * uring.h
+ *
+ * Optional io_uring client path for aesdsocket, built with USE_IO_URING=1.
+ * The ring talks to the kernel through the raw io_uring syscalls, so no
+ * liburing is needed on the target.
+ */
+
+#ifndef AESDSOCKET_URING_H
+#define AESDSOCKET_URING_H
+
+#ifndef USE_IO_URING
+#define USE_IO_URING 0
+#endif
+
+#if USE_IO_URING
+
+#include <sys/types.h>
+#include "rxbuf.h"
+
+struct uring_client;
+struct tx_queue;
+
+/**
+ * Set up a ring for the non-blocking socket @param client_fd, with the data
+ * file of @param shard registered as a fixed file. Replies are queued on
+ * @param out for the caller to flush.
+ * @return the new client, or NULL if no ring could be set up; the caller
+ * then serves the client with the regular recv() path
+ */
+struct uring_client *uring_client_new(int client_fd, int shard, struct tx_queue *out);
+
+/**
+ * Receive once into the registered buffer without waiting, chain the bytes
+ * into @param packet, append every complete line with the ring and queue
+ * its reply.
+ * @return the number of bytes received, 0 once the client is done (closed,
+ * or an error that was logged) or -1 with errno set to EAGAIN when there is
+ * nothing to receive
+ */
+ssize_t uring_client_recv(struct uring_client *uc, struct rx_packet *packet, struct rx_pool *pool);
+
+void uring_client_free(struct uring_client *uc);
+
+#endif
+
+#endif /* AESDSOCKET_URING_H */
@@ -0,0 +1,183 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+* Tests for the configurable capacity of the circular buffer: the power of two
+* ring behind it, the binary search over entry start offsets and the running
+* total size, and the baseline layout aesd_circular_buffer_init() keeps.
+* Offsets are checked against a linear walk of the entries.
+*/
+
+static char entry_text[512][16];
+
+static const char *add_numbered_entry(struct aesd_circular_buffer *buffer, int n)
+{
+    struct aesd_buffer_entry entry;
+    // Entry sizes vary so the start offsets aren't a multiple of one size
+    snprintf(entry_text[n % 512], sizeof(entry_text[0]), "w%d%.*s\n", n, n % 5, "xxxxx");
+    entry.buffptr = entry_text[n % 512];
+    entry.size = strlen(entry.buffptr);
+    return aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+static size_t linear_total(struct aesd_circular_buffer *buffer)
+{
+    size_t total = 0;
+    uint8_t index;
+    struct aesd_buffer_entry *entry;
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index) {
+        total += entry->size;
+    }
+    return total;
+}
+
+/**
+* Checks every byte offset of @param buffer, whose oldest entry is number
+* @param first, resolves to the right entry and offset within it
+*/
+static void verify_all_offsets(struct aesd_circular_buffer *buffer, int first, int count)
+{
+    size_t pos = 0;
+    size_t entry_offset;
+    char message[64];
+
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(linear_total(buffer), aesd_circular_buffer_size(buffer),
+                                   "running total differs from the sum of entry sizes");
+    for (int n = first; n < first + count; n++) {
+        const char *expected = entry_text[n % 512];
+        size_t size = strlen(expected);
+        size_t start;
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_get_entry(buffer, n - first, &start);
+        snprintf(message, sizeof(message), "entry %d", n);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, message);
+        TEST_ASSERT_EQUAL_UINT_MESSAGE(pos, start, message);
+        for (size_t i = 0; i < size; i++) {
+            entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, pos + i, &entry_offset);
+            TEST_ASSERT_NOT_NULL_MESSAGE(entry, message);
+            TEST_ASSERT_EQUAL_PTR_MESSAGE(expected, entry->buffptr, message);
+            TEST_ASSERT_EQUAL_UINT_MESSAGE(i, entry_offset, message);
+        }
+        pos += size;
+    }
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(pos, aesd_circular_buffer_size(buffer), "total size");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(buffer, pos, &entry_offset),
+                             "offset past the end must not resolve");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_get_entry(buffer, count, NULL),
+                             "entry past the newest must not resolve");
+}
+
+void test_circular_buffer_default_capacity()
+{
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+
+    TEST_ASSERT_EQUAL_UINT(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, buffer.capacity);
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, buffer.nr_slots,
+                                   "the default buffer keeps its entries in entry[]");
+    TEST_ASSERT_NULL(buffer.ring);
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, NULL));
+
+    for (int n = 0; n < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; n++) {
+        TEST_ASSERT_FALSE(buffer.full);
+        TEST_ASSERT_NULL(add_numbered_entry(&buffer, n));
+    }
+    TEST_ASSERT_TRUE_MESSAGE(buffer.full, "buffer must be full after 10 writes");
+    verify_all_offsets(&buffer, 0, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(entry_text[0], add_numbered_entry(&buffer, 10),
+                                  "the 11th write must hand back the oldest entry");
+    TEST_ASSERT_TRUE(buffer.full);
+    verify_all_offsets(&buffer, 1, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    aesd_circular_buffer_release(&buffer);
+}
+
+void test_circular_buffer_capacity_wraps_ring()
+{
+    // Odd capacities use a ring larger than the number of entries kept
+    const unsigned int capacities[] = { 1, 3, 5, 8, 16, 17, 100, AESDCHAR_MAX_CAPACITY };
+
+    for (size_t c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++) {
+        struct aesd_circular_buffer buffer;
+        int capacity = capacities[c];
+        TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(&buffer, capacity));
+        TEST_ASSERT_NOT_NULL(buffer.ring);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, buffer.nr_slots & (buffer.nr_slots - 1), "ring size is a power of two");
+        TEST_ASSERT_TRUE_MESSAGE(buffer.nr_slots > capacity, "a full ring keeps a free slot");
+
+        for (int n = 0; n < 3 * capacity + 7; n++) {
+            const char *overwritten = add_numbered_entry(&buffer, n);
+            if (n < capacity) {
+                TEST_ASSERT_NULL(overwritten);
+                verify_all_offsets(&buffer, 0, n + 1);
+            } else {
+                TEST_ASSERT_EQUAL_PTR(entry_text[(n - capacity) % 512], overwritten);
+                verify_all_offsets(&buffer, n + 1 - capacity, capacity);
+            }
+            TEST_ASSERT_EQUAL(n + 1 >= capacity, buffer.full);
+        }
+        aesd_circular_buffer_release(&buffer);
+    }
+}
+
+void test_circular_buffer_full_state()
+{
+    struct aesd_circular_buffer buffer;
+
+    // The default buffer is full with in_offs == out_offs, as it always was
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_EQUAL_UINT8_MESSAGE(buffer.out_offs, buffer.in_offs, "empty buffer");
+    for (int n = 0; n < 2 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3; n++) {
+        add_numbered_entry(&buffer, n);
+        TEST_ASSERT_EQUAL(buffer.full, buffer.in_offs == buffer.out_offs);
+    }
+    aesd_circular_buffer_release(&buffer);
+
+    // A ring of its own keeps the slot at in_offs free
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_init_capacity(&buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED));
+    for (int n = 0; n < 2 * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3; n++) {
+        add_numbered_entry(&buffer, n);
+        if (buffer.full) {
+            TEST_ASSERT_EQUAL_UINT8_MESSAGE((buffer.out_offs + buffer.capacity) % buffer.nr_slots, buffer.in_offs,
+                                            "a full ring ends capacity slots after out_offs");
+        }
+    }
+    aesd_circular_buffer_release(&buffer);
+}
+
+void test_circular_buffer_default_copies()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer copy;
+    struct aesd_buffer_entry *entry;
+    uint8_t index;
+    int visited = 0;
+    int held = 0;
+    aesd_circular_buffer_init(&buffer);
+    add_numbered_entry(&buffer, 0);
+
+    // The default buffer holds no pointers into itself, a copy stands alone
+    memcpy(&copy, &buffer, sizeof(copy));
+    add_numbered_entry(&copy, 1);
+    verify_all_offsets(&buffer, 0, 1);
+    verify_all_offsets(&copy, 0, 2);
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &copy, index) {
+        visited++;
+        if (entry->buffptr) held++;
+    }
+    TEST_ASSERT_EQUAL_INT(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, visited);
+    TEST_ASSERT_EQUAL_INT(2, held);
+    aesd_circular_buffer_release(&copy);
+    aesd_circular_buffer_release(&buffer);
+}
+
+void test_circular_buffer_capacity_limits()
+{
+    struct aesd_circular_buffer buffer;
+    TEST_ASSERT_EQUAL_INT(-EINVAL, aesd_circular_buffer_init_capacity(&buffer, 0));
+    TEST_ASSERT_EQUAL_INT(-EINVAL, aesd_circular_buffer_init_capacity(&buffer, AESDCHAR_MAX_CAPACITY + 1));
+}